@@ -16,14 +16,23 @@
 
 Hides specific buttons from the Windows 11 File Explorer command bar.
 
-You can choose which buttons to hide from the mod settings.
+You can choose which buttons to hide from the mod settings. Other buttons can
+be hidden with custom rules matching their icon, automation name, automation
+ID, label or type, optionally limited to buttons inside a named parent.
 
 ## How it works
 
 The mod hooks `CreateWindowExW` to detect when a File Explorer window
 (`CabinetWClass`) is created, then injects a XAML diagnostics TAP to monitor
 the visual tree. When `AppBarButton` elements become visible, it checks their
-icon's SVG URI to identify rotate/wallpaper buttons, and hides them.
+icon's SVG URI to identify rotate/wallpaper buttons, and hides them. A
+button's icon is also checked as it is added, so matching buttons are
+usually collapsed before they are first drawn.
+
+Settings changes apply to open windows right away. A button that is no longer
+hidden comes back the next time File Explorer updates it (for the rotate and
+wallpaper buttons, when the selection changes), since only File Explorer knows
+whether it should be showing.
 
 */
 // ==/WindhawkModReadme==
@@ -39,184 +48,2962 @@ icon's SVG URI to identify rotate/wallpaper buttons, and hides them.
 - hideSetAsDesktopBackground: true
   $name: Hide Set as Desktop Background button
   $description: Hides the set as desktop background button from the command bar
+- rules:
+  - - field: icon
+      $name: Match on
+      $options:
+      - icon: SVG icon filename
+      - automationName: Automation name
+      - automationId: Automation ID
+      - label: Label text
+      - type: Element type
+    - value: ""
+      $name: Value
+      $description: >-
+        Exact value to match, e.g. windows.rotate90.svg for an icon or
+        Microsoft.UI.Xaml.Controls.AppBarButton for a type
+    - scope: ""
+      $name: Parent scope
+      $description: >-
+        Optional x:Name of an ancestor element the button must be inside
+  $name: Custom hide rules
+  $description: Additional command bar buttons to hide
+- logLevel: info
+  $name: Log level
+  $options:
+  - error: Errors only
+  - info: Hidden buttons
+  - verbose: Hidden buttons and statistics
+- summarizeRepeats: true
+  $name: Summarize repeated log messages
+  $description: >-
+    Logs a repeat count instead of the same message over and over
+- traceFile: ""
+  $name: Trace file
+  $description: >-
+    For diagnostics only. If set, visual tree events and the properties the
+    mod reads are recorded to this file in a compact binary format
 */
 // ==/WindhawkModSettings==
 
 // Source code is published under The GNU General Public License v3.0.
 
-#include <xamlom.h>
+// With ECBH_CORE_ONLY defined, only the platform-independent core (rule
+// tables, caches, schedulers and the Tree-generic button logic) is compiled,
+// so the tests in tests/ can build it on any host.
+#ifndef ECBH_CORE_ONLY
+#include <xamlom.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef ECBH_CORE_ONLY
+// The few Windows definitions the core uses.
+using HRESULT = int32_t;
+using InstanceHandle = uint64_t;
+#define SUCCEEDED(hr) (static_cast<HRESULT>(hr) >= 0)
+#define ERROR_NOT_FOUND 1168L
+constexpr HRESULT HRESULT_FROM_WIN32(long x) {
+    return x <= 0 ? static_cast<HRESULT>(x)
+                  : static_cast<HRESULT>((x & 0x0000FFFF) | (7 << 16) | 0x80000000);
+}
+#endif
+
+#ifndef ECBH_CORE_ONLY
+#undef GetCurrentTime
+
+#include <winrt/Microsoft.UI.Xaml.h>
+#include <winrt/Microsoft.UI.Xaml.Automation.h>
+#include <winrt/Microsoft.UI.Xaml.Controls.h>
+#include <winrt/Microsoft.UI.Xaml.Media.h>
+#include <winrt/Microsoft.UI.Xaml.Media.Imaging.h>
+#include <winrt/Microsoft.UI.Dispatching.h>
+#include <winrt/Windows.Foundation.h>
+
+// ============================================================================
+// Globals
+// ============================================================================
+
+std::atomic<bool> g_initialized;
+bool g_disabled = false;
+
+namespace mux = winrt::Microsoft::UI::Xaml;
+namespace muxc = winrt::Microsoft::UI::Xaml::Controls;
+namespace muxm = winrt::Microsoft::UI::Xaml::Media;
+namespace wf = winrt::Windows::Foundation;
+#endif  // ECBH_CORE_ONLY
+
+// ============================================================================
+// Metrics
+// ============================================================================
+
+enum class Probe : uint32_t {
+    TreeChange,
+    Strategy1,  // AppBarButton added
+    Strategy2,  // AppBarSeparator added
+    Strategy3,  // TextLabel added
+    ProcessAppBarButton,
+    CleanupSeparators,
+    ReHideCallback,
+    InjectTap,
+    IconResolved,  // from a pending button's first check to its verdict
+    ScanSlice,     // one slice of the initial scan
+    TimeToHide,    // from a button's Add event to its collapse
+    TraceWrite,    // one trace buffer written, on the trace thread
+    Count,
+};
+
+static const wchar_t* const kProbeNames[] = {
+    L"TreeChange",
+    L"Strategy1",
+    L"Strategy2",
+    L"Strategy3",
+    L"ProcessAppBarButton",
+    L"CleanupSeparators",
+    L"ReHideCallback",
+    L"InjectTap",
+    L"IconResolved",
+    L"ScanSlice",
+    L"TimeToHide",
+    L"TraceWrite",
+};
+static_assert(std::size(kProbeNames) == static_cast<size_t>(Probe::Count));
+
+// Bucket i counts samples of [2^(i-1), 2^i) ns; bucket 0 is 0 ns.
+static constexpr size_t kLatencyBuckets = 40;
+
+// The sample count is the sum of the buckets, so a sample is two atomic adds.
+struct alignas(64) ProbeStats {
+    std::atomic<uint64_t> totalNs;
+    std::atomic<uint64_t> buckets[kLatencyBuckets];
+
+    uint64_t SampleCount() const {
+        uint64_t count = 0;
+        for (const auto& bucket : buckets) count += bucket.load(std::memory_order_relaxed);
+        return count;
+    }
+
+    // Upper bound of the bucket holding the given percentile, in ns.
+    uint64_t PercentileNs(uint64_t count, unsigned percent) const {
+        uint64_t target = (count * percent + 99) / 100;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kLatencyBuckets; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= target) return i ? (1ull << i) : 0;
+        }
+        return UINT64_MAX;
+    }
+};
+
+// Layout of the shared-memory block, readable by external tools while the
+// mod runs. Bump kMetricsVersion on any layout change.
+static constexpr uint32_t kMetricsMagic = 0x48424345;  // "ECBH"
+static constexpr uint32_t kMetricsVersion = 6;
+
+struct MetricsBlock {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t probeCount;
+    uint32_t bucketCount;
+    ProbeStats probes[static_cast<size_t>(Probe::Count)];
+};
+
+// Records samples into a MetricsBlock, timing them with Clock::Now(), a
+// monotonic tick count. Samples are relaxed atomic adds on a cache line per
+// probe; the only contention is between Explorer windows, which run on
+// separate threads. The block can be swapped while samples are recorded.
+template <typename Clock>
+class MetricsRecorder {
+public:
+    explicit MetricsRecorder(MetricsBlock* block) : m_block(block) {}
+
+    MetricsRecorder(const MetricsRecorder&) = delete;
+    MetricsRecorder& operator=(const MetricsRecorder&) = delete;
+
+    void SetFrequency(uint64_t ticksPerSecond) {
+        m_nsPerTickQ20 = (1000000000ull << 20) / ticksPerSecond;
+    }
+
+    MetricsBlock* Block() const { return m_block.load(); }
+    MetricsBlock* Swap(MetricsBlock* block) { return m_block.exchange(block); }
+
+    uint64_t ToNs(uint64_t ticks) const { return (ticks * m_nsPerTickQ20) >> 20; }
+    uint64_t ToTicks(uint64_t ns) const {
+        return m_nsPerTickQ20 ? (ns << 20) / m_nsPerTickQ20 : 0;
+    }
+
+    void Record(Probe probe, uint64_t ns) {
+        ProbeStats& stats =
+            m_block.load(std::memory_order_relaxed)->probes[static_cast<size_t>(probe)];
+        size_t bucket = std::min<size_t>(std::bit_width(ns), kLatencyBuckets - 1);
+        stats.totalNs.fetch_add(ns, std::memory_order_relaxed);
+        stats.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void RecordSince(Probe probe, uint64_t startTicks) {
+        Record(probe, ToNs(Clock::Now() - startTicks));
+    }
+
+    class Scope {
+    public:
+        Scope(MetricsRecorder& recorder, Probe probe)
+            : m_recorder(recorder), m_probe(probe), m_start(Clock::Now()) {}
+        ~Scope() { m_recorder.RecordSince(m_probe, m_start); }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        MetricsRecorder& m_recorder;
+        Probe m_probe;
+        uint64_t m_start;
+    };
+
+    // Times the caller's scope: auto probe = recorder.Measure(Probe::X);
+    Scope Measure(Probe probe) { return Scope(*this, probe); }
+
+private:
+    std::atomic<MetricsBlock*> m_block;
+    uint64_t m_nsPerTickQ20 = 0;  // nanoseconds per tick, 20-bit fixed point
+};
+
+#ifndef ECBH_CORE_ONLY
+struct QpcClock {
+    static uint64_t Now() {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        return counter.QuadPart;
+    }
+};
+
+MetricsBlock g_localMetrics;
+MetricsRecorder<QpcClock> g_metrics{&g_localMetrics};
+HANDLE g_metricsMapping;
+
+static uint64_t ReadTicks() {
+    return QpcClock::Now();
+}
+
+static uint64_t TicksToNs(uint64_t ticks) {
+    return g_metrics.ToNs(ticks);
+}
+
+static uint64_t NsToTicks(uint64_t ns) {
+    return g_metrics.ToTicks(ns);
+}
+
+static void InitializeMetrics() {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    g_metrics.SetFrequency(frequency.QuadPart);
+
+    MetricsBlock* block = &g_localMetrics;
+
+    WCHAR name[96];
+    wsprintf(name, L"Local\\explorer-command-bar-button-hider-metrics-%u",
+             GetCurrentProcessId());
+    g_metricsMapping = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr,
+                                         PAGE_READWRITE, 0, sizeof(MetricsBlock), name);
+    if (g_metricsMapping) {
+        void* view = MapViewOfFile(g_metricsMapping, FILE_MAP_ALL_ACCESS, 0, 0,
+                                   sizeof(MetricsBlock));
+        if (view) {
+            block = static_cast<MetricsBlock*>(view);
+        } else {
+            CloseHandle(g_metricsMapping);
+            g_metricsMapping = nullptr;
+        }
+    }
+    if (!g_metricsMapping) {
+        Wh_Log(L"Metrics shared memory unavailable: %u", GetLastError());
+    }
+
+    block->magic = kMetricsMagic;
+    block->version = kMetricsVersion;
+    block->probeCount = static_cast<uint32_t>(Probe::Count);
+    block->bucketCount = kLatencyBuckets;
+    g_metrics.Swap(block);
+}
+
+static void UninitializeMetrics() {
+    MetricsBlock* block = g_metrics.Swap(&g_localMetrics);
+    if (block != &g_localMetrics) {
+        UnmapViewOfFile(block);
+    }
+    if (g_metricsMapping) {
+        CloseHandle(g_metricsMapping);
+        g_metricsMapping = nullptr;
+    }
+}
+
+static void LogMetricsSummary() {
+    const MetricsBlock* block = g_metrics.Block();
+    std::wstring line = L"Metrics:";
+    for (size_t i = 0; i < static_cast<size_t>(Probe::Count); i++) {
+        const ProbeStats& stats = block->probes[i];
+        uint64_t count = stats.SampleCount();
+        if (!count) continue;
+        WCHAR part[160];
+        swprintf_s(part, ARRAYSIZE(part), L" %s n=%llu avg=%lluns p50<%lluns p99<%lluns;",
+                   kProbeNames[i], count,
+                   stats.totalNs.load(std::memory_order_relaxed) / count,
+                   stats.PercentileNs(count, 50), stats.PercentileNs(count, 99));
+        line += part;
+    }
+    Wh_Log(L"%s", line.c_str());
+}
+
+// Logs a summary at most once per minute.
+static void MaybeLogMetricsSummary() {
+    static std::atomic<ULONGLONG> lastLogged;
+    ULONGLONG now = GetTickCount64();
+    ULONGLONG last = lastLogged.load(std::memory_order_relaxed);
+    if (now - last < 60000) return;
+    if (!lastLogged.compare_exchange_strong(last, now)) return;
+    LogMetricsSummary();
+}
+
+#endif  // ECBH_CORE_ONLY
+
+// ============================================================================
+// Async logger
+// ============================================================================
+
+enum class LogLevel : uint8_t {
+    Error,
+    Info,     // hidden buttons, settings and unload summaries
+    Verbose,  // per-burst, per-window and periodic metrics statistics
+};
+
+// Levels above this are compiled out, e.g. -DLOG_MAX_LEVEL=0 in
+// @compilerOptions keeps errors only.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 2
+#endif
+
+std::atomic<LogLevel> g_logLevel{LogLevel::Info};
+std::atomic<bool> g_logSummarizeRepeats{true};
+
+template <LogLevel level>
+static bool LogEnabled() {
+    if constexpr (static_cast<int>(level) > LOG_MAX_LEVEL) {
+        return false;
+    } else {
+        return level <= g_logLevel.load(std::memory_order_relaxed);
+    }
+}
+
+// Hot-path messages are copied into a bounded lock-free ring and formatted
+// by a background thread, so UI threads never wait on Wh_Log. A message is
+// a string literal plus one detail string, truncated to kMaxDetail (icon
+// URIs fit). The ring is a bounded MPMC queue with a sequence number per
+// slot, used by many producers and one consumer; when it's full, messages
+// are dropped and counted.
+//
+// The consumer hands messages to a sink with Message(message, detail),
+// Repeated(count) and Dropped(count).
+class LogRing {
+public:
+    static constexpr size_t kCapacity = 256;
+    static constexpr size_t kMaxDetail = 120;
+
+    LogRing() {
+        for (size_t i = 0; i < kCapacity; i++) {
+            m_slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    void Push(const wchar_t* message, std::wstring_view detail) {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &m_slots[pos % kCapacity];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->record.message = message;
+        slot->record.length = static_cast<uint16_t>(std::min(detail.size(), kMaxDetail));
+        std::copy_n(detail.data(), slot->record.length, slot->record.detail);
+        slot->seq.store(pos + 1, std::memory_order_release);
+    }
+
+    // Consumer thread only. A run of repeats is summarized once a drain
+    // comes up empty.
+    template <typename Sink>
+    void Drain(Sink& sink) {
+        bool summarize = g_logSummarizeRepeats.load(std::memory_order_relaxed);
+        bool any = false;
+        Record record;
+        while (Pop(record)) {
+            any = true;
+            if (summarize && m_hasLast && record.message == m_last.message &&
+                std::wstring_view(record.detail, record.length) ==
+                    std::wstring_view(m_last.detail, m_last.length)) {
+                m_repeats++;
+                continue;
+            }
+            FlushRepeats(sink);
+            sink.Message(record.message, std::wstring_view(record.detail, record.length));
+            m_last = record;
+            m_hasLast = true;
+        }
+        if (!any) FlushRepeats(sink);
+
+        if (uint64_t dropped = m_dropped.exchange(0, std::memory_order_relaxed)) {
+            sink.Dropped(dropped);
+        }
+    }
+
+    template <typename Sink>
+    void FlushRepeats(Sink& sink) {
+        if (!m_repeats) return;
+        sink.Repeated(m_repeats);
+        m_repeats = 0;
+    }
+
+private:
+    struct Record {
+        const wchar_t* message;
+        uint16_t length;
+        wchar_t detail[kMaxDetail];
+    };
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        Record record;
+    };
+
+    bool Pop(Record& record) {
+        Slot& slot = m_slots[m_head % kCapacity];
+        if (slot.seq.load(std::memory_order_acquire) != m_head + 1) return false;
+        record.message = slot.record.message;
+        record.length = slot.record.length;
+        std::copy_n(slot.record.detail, record.length, record.detail);
+        slot.seq.store(m_head + kCapacity, std::memory_order_release);
+        m_head++;
+        return true;
+    }
+
+    Slot m_slots[kCapacity];
+    alignas(64) std::atomic<size_t> m_tail{0};
+    alignas(64) std::atomic<uint64_t> m_dropped{0};
+
+    // Consumer thread only
+    alignas(64) size_t m_head = 0;
+    Record m_last;
+    bool m_hasLast = false;
+    unsigned m_repeats = 0;
+};
+
+#ifndef ECBH_CORE_ONLY
+struct WhLogSink {
+    void Message(const wchar_t* message, std::wstring_view detail) {
+        Wh_Log(L"%s: %.*s", message, (int)detail.size(), detail.data());
+    }
+    void Repeated(unsigned count) {
+        Wh_Log(L"(last message repeated %u more times)", count);
+    }
+    void Dropped(uint64_t count) {
+        Wh_Log(L"%llu log messages dropped", count);
+    }
+};
+
+// Drains a LogRing every 50 ms on a thread of its own.
+class AsyncLog {
+public:
+    bool Running() const { return m_thread != nullptr; }
+
+    void Push(const wchar_t* message, std::wstring_view detail) {
+        m_ring.Push(message, detail);
+    }
+
+    bool Start() {
+        m_stop = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        if (!m_stop) return false;
+        m_thread = CreateThread(nullptr, 0, ThreadProc, this, 0, nullptr);
+        if (!m_thread) {
+            CloseHandle(m_stop);
+            m_stop = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    // Writes out everything queued so far and stops the thread.
+    void Stop() {
+        if (!m_thread) return;
+        SetEvent(m_stop);
+        WaitForSingleObject(m_thread, INFINITE);
+        CloseHandle(m_thread);
+        CloseHandle(m_stop);
+        m_thread = nullptr;
+        m_stop = nullptr;
+    }
+
+private:
+    // The periodic metrics summary is built here too, so UI threads never
+    // format it.
+    static DWORD WINAPI ThreadProc(void* param) {
+        auto* log = static_cast<AsyncLog*>(param);
+        WhLogSink sink;
+        while (WaitForSingleObject(log->m_stop, 50) == WAIT_TIMEOUT) {
+            log->m_ring.Drain(sink);
+            if (LogEnabled<LogLevel::Verbose>()) MaybeLogMetricsSummary();
+        }
+        log->m_ring.Drain(sink);
+        log->m_ring.FlushRepeats(sink);
+        return 0;
+    }
+
+    LogRing m_ring;
+    HANDLE m_thread = nullptr;
+    HANDLE m_stop = nullptr;
+};
+
+AsyncLog g_asyncLog;
+
+// Logs "message: detail" without formatting on the calling thread. message
+// must be a string literal.
+template <LogLevel level>
+static void LogHot(const wchar_t* message, std::wstring_view detail) {
+    if (!LogEnabled<level>()) return;
+    if (!g_asyncLog.Running()) {
+        Wh_Log(L"%s: %.*s", message, (int)detail.size(), detail.data());
+        return;
+    }
+    g_asyncLog.Push(message, detail);
+}
+#endif  // ECBH_CORE_ONLY
+
+// ============================================================================
+// Trace recorder
+// ============================================================================
+
+// Binary trace of the visual tree event stream and of the properties the mod
+// reads while handling it, for replaying real sessions offline. All values
+// are little-endian. The file starts with:
+//   char magic[4] = "ECBT"; u32 version; u64 ticksPerSecond;
+// followed by records, each starting with u8 kind and u64 ticks (QPC):
+//   TreeChange: u8 mutation; u64 parent; u64 child; u32 childIndex;
+//               u64 handle; u32 numChildren; str type; str name
+//   IconUri:    u64 element; u8 verdict; str uri
+//   Children:   u64 parent; u32 count; u8 flags[count] (1 = separator,
+//               2 = visible)
+// where str is u16 length followed by that many UTF-16 code units, and
+// element/parent in snapshot records are the same InstanceHandles as in
+// TreeChange records (0 if the handle couldn't be looked up).
+enum class TraceRecord : uint8_t {
+    TreeChange = 1,
+    IconUri = 2,
+    Children = 3,
+};
+
+static constexpr uint32_t kTraceVersion = 2;
+
+#ifndef ECBH_CORE_ONLY
+static constexpr size_t kTraceFlushSize = 64 * 1024;
+static constexpr size_t kTraceMaxBacklog = 64;  // full buffers, 4 MB
+
+// Records are appended on the UI thread; full buffers are handed to a
+// writer thread, so the UI thread never waits on the disk. If the disk
+// can't keep up, buffers beyond kTraceMaxBacklog are dropped and counted.
+class TraceWriter {
+public:
+    bool Open(const wchar_t* path) {
+        std::lock_guard lock(m_mutex);
+        m_file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) {
+            m_file = nullptr;
+            return false;
+        }
+
+        m_stopping = false;
+        m_wake = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        m_thread = m_wake ? CreateThread(nullptr, 0, WriterProc, this, 0, nullptr) : nullptr;
+        if (!m_thread) {
+            if (m_wake) CloseHandle(m_wake);
+            m_wake = nullptr;
+            CloseHandle(m_file);
+            m_file = nullptr;
+            return false;
+        }
+
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        m_buffer.insert(m_buffer.end(), {'E', 'C', 'B', 'T'});
+        Put(kTraceVersion);
+        Put(static_cast<uint64_t>(frequency.QuadPart));
+        m_enabled = true;
+        return true;
+    }
+
+    void Close() {
+        HANDLE thread;
+        {
+            std::lock_guard lock(m_mutex);
+            m_enabled = false;
+            if (!m_file) return;
+            FlushLocked();
+            m_stopping = true;
+            thread = m_thread;
+        }
+
+        // The writer drains the backlog before exiting.
+        SetEvent(m_wake);
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+        CloseHandle(m_wake);
+
+        std::lock_guard lock(m_mutex);
+        CloseHandle(m_file);
+        m_file = nullptr;
+        m_thread = nullptr;
+        m_wake = nullptr;
+        m_buffer.clear();
+        if (m_droppedBuffers) {
+            Wh_Log(L"Trace: dropped %zu buffers the disk couldn't keep up with",
+                   m_droppedBuffers);
+            m_droppedBuffers = 0;
+        }
+    }
+
+    bool Enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    void TreeChange(const ParentChildRelation& relation, const VisualElement& element,
+                    VisualMutationType mutationType) {
+        std::lock_guard lock(m_mutex);
+        if (!m_file || m_stopping) return;
+        BeginLocked(TraceRecord::TreeChange);
+        Put(static_cast<uint8_t>(mutationType));
+        Put(static_cast<uint64_t>(relation.Parent));
+        Put(static_cast<uint64_t>(relation.Child));
+        Put(static_cast<uint32_t>(relation.ChildIndex));
+        Put(static_cast<uint64_t>(element.Handle));
+        Put(static_cast<uint32_t>(element.NumChildren));
+        PutString(element.Type ? element.Type : L"");
+        PutString(element.Name ? element.Name : L"");
+        EndLocked();
+    }
+
+    void IconUri(uint64_t element, uint8_t verdict, std::wstring_view uri) {
+        std::lock_guard lock(m_mutex);
+        if (!m_file || m_stopping) return;
+        BeginLocked(TraceRecord::IconUri);
+        Put(element);
+        Put(verdict);
+        PutString(uri);
+        EndLocked();
+    }
+
+    void Children(uint64_t parent, const uint8_t* flags, uint32_t count) {
+        std::lock_guard lock(m_mutex);
+        if (!m_file || m_stopping) return;
+        BeginLocked(TraceRecord::Children);
+        Put(parent);
+        Put(count);
+        m_buffer.insert(m_buffer.end(), flags, flags + count);
+        EndLocked();
+    }
+
+private:
+    template <typename T>
+    void Put(T value) {
+        auto bytes = reinterpret_cast<const uint8_t*>(&value);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    void PutString(std::wstring_view str) {
+        uint16_t length = static_cast<uint16_t>(std::min<size_t>(str.size(), UINT16_MAX));
+        Put(length);
+        auto bytes = reinterpret_cast<const uint8_t*>(str.data());
+        m_buffer.insert(m_buffer.end(), bytes, bytes + length * sizeof(wchar_t));
+    }
+
+    void BeginLocked(TraceRecord kind) {
+        Put(static_cast<uint8_t>(kind));
+        Put(ReadTicks());
+    }
+
+    void EndLocked() {
+        if (m_buffer.size() >= kTraceFlushSize) FlushLocked();
+    }
+
+    // Hands the current buffer to the writer thread.
+    void FlushLocked() {
+        if (m_buffer.empty()) return;
+        if (m_backlog.size() >= kTraceMaxBacklog) {
+            m_droppedBuffers++;
+            m_buffer.clear();
+            return;
+        }
+        m_backlog.push_back(std::move(m_buffer));
+        m_buffer = {};
+        m_buffer.reserve(kTraceFlushSize + 1024);
+        SetEvent(m_wake);
+    }
+
+    static DWORD WINAPI WriterProc(void* param) {
+        auto* trace = static_cast<TraceWriter*>(param);
+        std::vector<std::vector<uint8_t>> buffers;
+        for (;;) {
+            WaitForSingleObject(trace->m_wake, INFINITE);
+            bool stopping;
+            {
+                std::lock_guard lock(trace->m_mutex);
+                buffers.swap(trace->m_backlog);
+                stopping = trace->m_stopping;
+            }
+            for (const auto& buffer : buffers) {
+                auto probe = g_metrics.Measure(Probe::TraceWrite);
+                DWORD written;
+                WriteFile(trace->m_file, buffer.data(), (DWORD)buffer.size(), &written, nullptr);
+            }
+            buffers.clear();
+            if (stopping) return 0;
+        }
+    }
+
+    std::mutex m_mutex;
+    HANDLE m_file = nullptr;
+    std::vector<uint8_t> m_buffer;
+    std::vector<std::vector<uint8_t>> m_backlog;
+    size_t m_droppedBuffers = 0;
+    bool m_stopping = false;
+    HANDLE m_wake = nullptr;
+    HANDLE m_thread = nullptr;
+    std::atomic<bool> m_enabled;
+};
+
+TraceWriter g_trace;
+
+// The diagnostics interface of the attached watcher, for looking up the
+// handles snapshot records are keyed by.
+std::atomic<IXamlDiagnostics*> g_traceDiagnostics;
+
+static uint64_t TraceHandleOf(wf::IInspectable const& element) {
+    IXamlDiagnostics* diagnostics = g_traceDiagnostics.load();
+    InstanceHandle handle = 0;
+    if (!diagnostics || !element ||
+        FAILED(diagnostics->GetHandleFromIInspectable(
+            reinterpret_cast<::IInspectable*>(winrt::get_abi(element)), &handle))) {
+        return 0;
+    }
+    return static_cast<uint64_t>(handle);
+}
+#endif  // ECBH_CORE_ONLY
+
+// ============================================================================
+// String table
+// ============================================================================
+
+// FNV-1a, folded to size_t.
+static size_t HashString(std::wstring_view s) {
+    uint64_t h = 14695981039346656037ull;
+    for (wchar_t c : s) {
+        h ^= static_cast<uint16_t>(c);
+        h *= 1099511628211ull;
+    }
+    return static_cast<size_t>(h ^ (h >> 32));
+}
+
+// Open-addressed hash table assigning dense indices to strings.
+class StringTable {
+public:
+    // Returns the index of key, adding it first if needed.
+    uint32_t Insert(std::wstring_view key) {
+        if (int32_t index = Find(key); index >= 0) return index;
+        m_names.emplace_back(key);
+        if ((m_names.size() * 2) > m_slots.size()) {
+            Rehash(m_slots.empty() ? 8 : m_slots.size() * 2);
+        } else {
+            Place(m_names.size() - 1);
+        }
+        return static_cast<uint32_t>(m_names.size() - 1);
+    }
+
+    // Returns the index of key, or -1.
+    int32_t Find(std::wstring_view key) const {
+        if (m_slots.empty()) return -1;
+        for (size_t i = HashString(key) & m_mask;; i = (i + 1) & m_mask) {
+            uint32_t slot = m_slots[i];
+            if (!slot) return -1;
+            if (m_names[slot - 1] == key) return static_cast<int32_t>(slot - 1);
+        }
+    }
+
+    size_t Size() const { return m_names.size(); }
+
+private:
+    void Place(size_t index) {
+        size_t i = HashString(m_names[index]) & m_mask;
+        while (m_slots[i]) i = (i + 1) & m_mask;
+        m_slots[i] = static_cast<uint32_t>(index + 1);
+    }
+
+    void Rehash(size_t capacity) {
+        m_slots.assign(capacity, 0);
+        m_mask = capacity - 1;
+        for (size_t i = 0; i < m_names.size(); i++) Place(i);
+    }
+
+    std::vector<std::wstring> m_names;
+    std::vector<uint32_t> m_slots;  // index + 1 into m_names, 0 = empty
+    size_t m_mask = 0;
+};
+
+// Returns the last path segment of a URI, without query or fragment, in a
+// single backward pass.
+static std::wstring_view UriFileName(std::wstring_view uri) {
+    size_t end = uri.size();
+    size_t i = uri.size();
+    while (i > 0) {
+        wchar_t c = uri[i - 1];
+        if (c == L'/' || c == L'\\') break;
+        if (c == L'?' || c == L'#') end = i - 1;
+        i--;
+    }
+    return uri.substr(i, end - i);
+}
+
+// ============================================================================
+// Hide rules
+// ============================================================================
+
+// Ordered from cheapest to most expensive to read from an element.
+enum class RuleField : uint8_t {
+    Type,
+    AutomationId,
+    AutomationName,
+    Label,
+    Icon,  // SVG icon filename
+    Count,
+};
+
+static constexpr size_t kRuleFieldCount = static_cast<size_t>(RuleField::Count);
+
+struct HideRule {
+    RuleField field;
+    std::wstring value;
+    std::wstring scope;  // x:Name of a required ancestor, empty for none
+};
+
+struct BuiltinRule {
+    const wchar_t* setting;
+    std::wstring_view iconFileName;  // language-independent
+};
+
+// The built-in buttons are all icon rules, so the default configuration
+// compiles to a table that reads nothing but the icon URI.
+static constexpr BuiltinRule kBuiltinRules[] = {
+    {L"hideRotateLeft", L"windows.rotate270.svg"},
+    {L"hideRotateRight", L"windows.rotate90.svg"},
+    {L"hideSetAsDesktopBackground", L"windows.setdesktopwallpaper.svg"},
+};
+static_assert(std::size(kBuiltinRules) <= 32);
+
+// Rules compiled into one hash table per field. A button is evaluated in a
+// single pass over the fields that have rules, with one lookup per field;
+// fields without rules are never read. Ancestors are only walked for a value
+// that matched a scoped rule.
+//
+// Enabled built-in rules are a bit mask instead, compared against their
+// constexpr file names ahead of the icon table, so the default
+// configuration costs a length check per built-in and never hashes.
+class RuleTable {
+public:
+    void AddBuiltin(size_t index) {
+        uint32_t bit = 1u << index;
+        if (m_builtins & bit) return;
+        m_builtins |= bit;
+        m_size++;
+    }
+
+    void Add(const HideRule& rule) {
+        if (rule.value.empty()) return;
+        FieldTable& table = m_fields[static_cast<size_t>(rule.field)];
+        uint32_t index = table.values.Insert(rule.value);
+        if (index >= table.groups.size()) table.groups.resize(index + 1);
+        Group& group = table.groups[index];
+        if (rule.scope.empty()) {
+            group.unscoped = true;
+        } else {
+            group.scopes.push_back(rule.scope);
+        }
+        m_size++;
+    }
+
+    bool UsesField(RuleField field) const {
+        return m_fields[static_cast<size_t>(field)].values.Size() > 0 ||
+               (field == RuleField::Icon && m_builtins);
+    }
+
+    size_t Size() const { return m_size; }
+
+    // getField(field) returns the element's value for a field, empty if it
+    // isn't available; inScope(name) tells whether an ancestor has that
+    // x:Name. Returns the field that matched, or RuleField::Count.
+    template <typename GetField, typename InScope>
+    RuleField Evaluate(GetField&& getField, InScope&& inScope) const {
+        for (size_t f = 0; f < kRuleFieldCount; f++) {
+            auto field = static_cast<RuleField>(f);
+            if (!UsesField(field)) continue;
+
+            std::wstring_view value = getField(field);
+            if (value.empty()) continue;
+            if (field == RuleField::Icon) {
+                value = UriFileName(value);
+                if (MatchesBuiltin(value)) return field;
+            }
+
+            const FieldTable& table = m_fields[f];
+            if (!table.values.Size()) continue;
+            int32_t index = table.values.Find(value);
+            if (index < 0) continue;
+
+            const Group& group = table.groups[index];
+            if (group.unscoped) return field;
+            for (const auto& scope : group.scopes) {
+                if (inScope(scope)) return field;
+            }
+        }
+        return RuleField::Count;
+    }
+
+private:
+    bool MatchesBuiltin(std::wstring_view fileName) const {
+        for (size_t i = 0; i < std::size(kBuiltinRules); i++) {
+            if ((m_builtins & (1u << i)) && fileName == kBuiltinRules[i].iconFileName) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    struct Group {
+        bool unscoped = false;
+        std::vector<std::wstring> scopes;
+    };
+
+    struct FieldTable {
+        StringTable values;
+        std::vector<Group> groups;  // parallel to values
+    };
+
+    FieldTable m_fields[kRuleFieldCount];
+    uint32_t m_builtins = 0;  // bit i: kBuiltinRules[i] enabled
+    size_t m_size = 0;
+};
+
+enum class IconVerdict {
+    Pending,  // icon not loaded yet
+    Keep,
+    Hide,
+};
+
+// A button's verdict and the text that decided it: the icon URI, or the
+// matched value of a non-icon rule. Text is whatever string type the tree
+// hands out field values as.
+template <typename Text>
+struct Classification {
+    Text uri;
+    IconVerdict verdict = IconVerdict::Pending;
+};
+
+// Evaluates rules against one element. getField(field) returns the
+// element's value for a field as a Text, empty if it isn't available;
+// inScope(name) tells whether an ancestor has that x:Name. Without a match,
+// the verdict stays Pending while the rules need an icon that hasn't loaded.
+template <typename Text, typename GetField, typename InScope>
+static Classification<Text> ClassifyWithRules(const RuleTable& rules, GetField&& getField,
+                                              InScope&& inScope) {
+    Classification<Text> result;
+    Text value{};
+    RuleField matched = rules.Evaluate(
+        [&](RuleField field) -> std::wstring_view {
+            value = getField(field);
+            if (field == RuleField::Icon) result.uri = value;
+            return value;
+        },
+        std::forward<InScope>(inScope));
+
+    if (matched != RuleField::Count) {
+        result.verdict = IconVerdict::Hide;
+        if (matched != RuleField::Icon) result.uri = value;
+    } else if (!rules.UsesField(RuleField::Icon) || !std::wstring_view(result.uri).empty()) {
+        result.verdict = IconVerdict::Keep;
+    }
+    return result;
+}
+
+// ============================================================================
+// Settings snapshots
+// ============================================================================
+
+// Immutable snapshots, swapped atomically when the settings change. Readers
+// on any thread take the current one without a lock. A replaced snapshot is
+// kept until the store goes away at unload, as a reader may still be using
+// it; settings changes are rare enough for that to cost nothing.
+template <typename T>
+class SnapshotStore {
+public:
+    // Called by one writer at a time (Windhawk serializes settings changes).
+    const T& Publish(std::unique_ptr<const T> snapshot) {
+        const T* current = snapshot.get();
+        m_snapshots.push_back(std::move(snapshot));
+        m_current.store(current, std::memory_order_release);
+        return *current;
+    }
+
+    // Null until the first Publish.
+    const T* Current() const { return m_current.load(std::memory_order_acquire); }
+
+    // Snapshots published so far, the current one included. Writer only.
+    size_t Count() const { return m_snapshots.size(); }
+
+private:
+    std::atomic<const T*> m_current{nullptr};
+    std::vector<std::unique_ptr<const T>> m_snapshots;
+};
+
+#ifndef ECBH_CORE_ONLY
+struct Settings {
+    bool builtinRules[ARRAYSIZE(kBuiltinRules)];
+    std::vector<HideRule> customRules;
+    std::wstring traceFile;
+    RuleTable rules;
+};
+
+SnapshotStore<Settings> g_settings;
+
+static const Settings& CurrentSettings() {
+    return *g_settings.Current();
+}
+
+// ============================================================================
+// Icon matching
+// ============================================================================
+
+// The URI is returned as the hstring WinRT hands back, so neither a hit nor a
+// miss allocates on our side.
+static winrt::hstring GetButtonSvgUri(mux::DependencyObject element) {
+    try {
+        auto abb = element.try_as<muxc::AppBarButton>();
+        if (!abb) return {};
+        auto icon = abb.Icon();
+        if (!icon) return {};
+        auto imageIcon = icon.try_as<muxc::ImageIcon>();
+        if (!imageIcon) return {};
+        auto source = imageIcon.Source();
+        if (!source) return {};
+        auto svg = source.try_as<muxm::Imaging::SvgImageSource>();
+        if (!svg) return {};
+        auto uri = svg.UriSource();
+        if (!uri) return {};
+        return uri.AbsoluteUri();
+    } catch (...) {}
+    return {};
+}
+
+using ButtonIcon = Classification<winrt::hstring>;
+
+static winrt::hstring GetRuleField(mux::DependencyObject const& element, RuleField field) {
+    try {
+        switch (field) {
+        case RuleField::Type:
+            return winrt::get_class_name(element);
+        case RuleField::AutomationId:
+            return mux::Automation::AutomationProperties::GetAutomationId(element);
+        case RuleField::AutomationName:
+            return mux::Automation::AutomationProperties::GetName(element);
+        case RuleField::Label:
+            if (auto abb = element.try_as<muxc::AppBarButton>()) return abb.Label();
+            return {};
+        case RuleField::Icon:
+            return GetButtonSvgUri(element);
+        case RuleField::Count:
+            break;
+        }
+    } catch (...) {}
+    return {};
+}
+
+// Whether an ancestor within 32 levels has the given x:Name.
+static bool HasAncestorNamed(mux::DependencyObject const& element, std::wstring_view name) {
+    auto current = muxm::VisualTreeHelper::GetParent(element);
+    for (int depth = 0; depth < 32 && current; depth++) {
+        auto fe = current.try_as<mux::FrameworkElement>();
+        if (fe && std::wstring_view(fe.Name()) == name) return true;
+        current = muxm::VisualTreeHelper::GetParent(current);
+    }
+    return false;
+}
+
+static ButtonIcon ClassifyButtonUncached(mux::DependencyObject element) {
+    ButtonIcon result = ClassifyWithRules<winrt::hstring>(CurrentSettings().rules,
+        [&](RuleField field) { return GetRuleField(element, field); },
+        [&](std::wstring_view scope) { return HasAncestorNamed(element, scope); });
+
+    if (g_trace.Enabled()) {
+        g_trace.IconUri(TraceHandleOf(element), static_cast<uint8_t>(result.verdict),
+                        result.uri);
+    }
+    return result;
+}
+#endif  // ECBH_CORE_ONLY
+
+// ============================================================================
+// Element identity cache
+// ============================================================================
+
+// Values keyed by element identity. The caller stores a weak reference next
+// to each value and checks it on lookup, so a recycled address never returns
+// another element's value, and the cache never keeps an element alive.
+//
+// Entries live in a pool of fixed-size chunks, recycled through a free list,
+// under an open-addressed index: once the pool has grown to the peak number
+// of live elements, elements coming and going allocate nothing, and entry
+// addresses stay stable. Dead entries are purged in one batch whenever the
+// table doubles in size, or on demand through Purge.
+template <typename Ref, typename Value>
+class IdentityCache {
+public:
+    struct Entry {
+        Ref ref;
+        Value value;
+        bool valid = false;
+    };
+
+    Entry* Find(const void* key) {
+        size_t slot = FindSlot(key);
+        return slot != kNoSlot ? &ItemAt(m_index[slot] - 1).entry : nullptr;
+    }
+
+    template <typename IsAlive>
+    Entry& Store(const void* key, Ref ref, Value value, IsAlive isAlive) {
+        if (m_size >= m_sweepAt) {
+            Purge(isAlive);
+            m_sweepAt = std::max<size_t>(kMinSweepAt, m_size * 2);
+        }
+        Entry* entry = Find(key);
+        if (!entry) entry = &Insert(key);
+        entry->ref = std::move(ref);
+        entry->value = std::move(value);
+        entry->valid = true;
+        return *entry;
+    }
+
+    void Invalidate(const void* key) {
+        if (auto* entry = Find(key)) entry->valid = false;
+    }
+
+    void Erase(const void* key) {
+        size_t slot = FindSlot(key);
+        if (slot == kNoSlot) return;
+        Release(m_index[slot] - 1);
+        RemoveSlot(slot);
+    }
+
+    // Drops every entry whose element is gone. Returns how many were dropped.
+    template <typename IsAlive>
+    size_t Purge(IsAlive isAlive) {
+        size_t purged = 0;
+        for (uint32_t i = 0; i < m_used; i++) {
+            Item& item = ItemAt(i);
+            if (item.key && !isAlive(item.entry.ref)) {
+                Erase(item.key);
+                purged++;
+            }
+        }
+        return purged;
+    }
+
+    void Clear() {
+        m_chunks.clear();
+        m_free.clear();
+        m_index.clear();
+        m_mask = 0;
+        m_used = 0;
+        m_size = 0;
+    }
+
+    // Calls f(key, entry) for every entry. f may erase entries.
+    template <typename F>
+    void ForEach(F f) {
+        for (uint32_t i = 0; i < m_used; i++) {
+            Item& item = ItemAt(i);
+            if (item.key) f(item.key, item.entry);
+        }
+    }
+
+    size_t Size() const { return m_size; }
+
+    // Memory held by the pool and the index.
+    size_t Bytes() const {
+        return m_chunks.size() * kChunkSize * sizeof(Item) +
+               m_chunks.capacity() * sizeof(m_chunks[0]) +
+               m_index.capacity() * sizeof(uint32_t) +
+               m_free.capacity() * sizeof(uint32_t);
+    }
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;
+
+private:
+    static constexpr size_t kMinSweepAt = 64;
+    static constexpr size_t kChunkSize = 64;
+    static constexpr size_t kNoSlot = SIZE_MAX;
+
+    struct Item {
+        const void* key = nullptr;  // null while in the free list
+        Entry entry;
+    };
+
+    static size_t Hash(const void* key) {
+        uint64_t k = reinterpret_cast<uintptr_t>(key);
+        return static_cast<size_t>((k * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    Item& ItemAt(uint32_t index) {
+        return m_chunks[index / kChunkSize][index % kChunkSize];
+    }
+
+    size_t FindSlot(const void* key) {
+        if (m_index.empty()) return kNoSlot;
+        for (size_t i = Hash(key) & m_mask;; i = (i + 1) & m_mask) {
+            uint32_t slot = m_index[i];
+            if (!slot) return kNoSlot;
+            if (ItemAt(slot - 1).key == key) return i;
+        }
+    }
+
+    Entry& Insert(const void* key) {
+        if ((m_size + 1) * 2 > m_index.size()) {
+            Rehash(std::max<size_t>(16, m_index.size() * 2));
+        }
+
+        uint32_t index;
+        if (!m_free.empty()) {
+            index = m_free.back();
+            m_free.pop_back();
+        } else {
+            if (m_used == m_chunks.size() * kChunkSize) {
+                m_chunks.push_back(std::make_unique<Item[]>(kChunkSize));
+            }
+            index = m_used++;
+        }
+
+        ItemAt(index).key = key;
+        Place(key, index);
+        m_size++;
+        return ItemAt(index).entry;
+    }
+
+    void Place(const void* key, uint32_t index) {
+        size_t i = Hash(key) & m_mask;
+        while (m_index[i]) i = (i + 1) & m_mask;
+        m_index[i] = index + 1;
+    }
+
+    void Rehash(size_t capacity) {
+        m_index.assign(capacity, 0);
+        m_mask = capacity - 1;
+        for (uint32_t i = 0; i < m_used; i++) {
+            if (ItemAt(i).key) Place(ItemAt(i).key, i);
+        }
+    }
+
+    // Returns an item to the pool, dropping its reference and value.
+    void Release(uint32_t index) {
+        Item& item = ItemAt(index);
+        item.key = nullptr;
+        item.entry = Entry{};
+        m_free.push_back(index);
+        m_size--;
+    }
+
+    // Backward-shift deletion: later entries of the probe chain move into
+    // the hole unless their home slot lies between the hole and them, so
+    // lookups never need tombstones.
+    void RemoveSlot(size_t hole) {
+        for (size_t i = (hole + 1) & m_mask;; i = (i + 1) & m_mask) {
+            uint32_t slot = m_index[i];
+            if (!slot) break;
+            size_t home = Hash(ItemAt(slot - 1).key) & m_mask;
+            if (((i - home) & m_mask) >= ((i - hole) & m_mask)) {
+                m_index[hole] = slot;
+                hole = i;
+            }
+        }
+        m_index[hole] = 0;
+    }
+
+    std::vector<std::unique_ptr<Item[]>> m_chunks;
+    std::vector<uint32_t> m_free;
+    std::vector<uint32_t> m_index;  // item index + 1, 0 = empty
+    size_t m_mask = 0;
+    uint32_t m_used = 0;  // items handed out of the chunks so far
+    size_t m_size = 0;
+    size_t m_sweepAt = kMinSweepAt;
+};
+
+// ============================================================================
+// Type name classifier
+// ============================================================================
+
+enum class TreeTypeClass : uint8_t {
+    Irrelevant,
+    AppBarButton,
+    AppBarSeparator,
+    TextBlock,
+    ImageIcon,
+};
+
+static TreeTypeClass ClassifyTypeNameUncached(std::wstring_view typeName) {
+    if (typeName.find(L"AppBarButton") != std::wstring_view::npos) {
+        return TreeTypeClass::AppBarButton;
+    }
+    if (typeName.find(L"AppBarSeparator") != std::wstring_view::npos) {
+        return TreeTypeClass::AppBarSeparator;
+    }
+    if (typeName.find(L"TextBlock") != std::wstring_view::npos) {
+        return TreeTypeClass::TextBlock;
+    }
+    if (typeName.find(L"ImageIcon") != std::wstring_view::npos) {
+        return TreeTypeClass::ImageIcon;
+    }
+    return TreeTypeClass::Irrelevant;
+}
+
+// Memoizes the class of each distinct type name in an open-addressed table.
+// Type strings are freed after each callback, so entries own a copy and are
+// keyed by content. A window only has a few hundred distinct types, so once
+// warm, nearly every event costs one hash and one probe.
+class TypeNameClassifier {
+public:
+    TreeTypeClass Classify(std::wstring_view typeName) {
+        if ((m_count + 1) * 2 > m_slots.size()) {
+            Grow();
+        }
+
+        size_t hash = HashString(typeName);
+        size_t mask = m_slots.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            Slot& slot = m_slots[i];
+            if (!slot.used) {
+                slot.used = true;
+                slot.hash = hash;
+                slot.name = typeName;
+                slot.typeClass = ClassifyTypeNameUncached(typeName);
+                m_count++;
+                misses++;
+                return slot.typeClass;
+            }
+            if (slot.hash == hash && slot.name == typeName) {
+                hits++;
+                return slot.typeClass;
+            }
+        }
+    }
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+private:
+    struct Slot {
+        size_t hash = 0;
+        std::wstring name;
+        TreeTypeClass typeClass = TreeTypeClass::Irrelevant;
+        bool used = false;
+    };
+
+    void Grow() {
+        std::vector<Slot> old(m_slots.empty() ? 256 : m_slots.size() * 2);
+        old.swap(m_slots);
+        size_t mask = m_slots.size() - 1;
+        for (Slot& slot : old) {
+            if (!slot.used) continue;
+            size_t i = slot.hash & mask;
+            while (m_slots[i].used) i = (i + 1) & mask;
+            m_slots[i] = std::move(slot);
+        }
+    }
+
+    std::vector<Slot> m_slots;
+    size_t m_count = 0;
+};
+
+// ============================================================================
+// Property callback registry
+// ============================================================================
+
+enum class CallbackPurpose : uint8_t {
+    ReHide,
+    DeferredCheck,
+    IconChanged,
+    LabelChanged,
+    NameChanged,          // AutomationProperties.Name
+    AutomationIdChanged,
+    Count,
+};
+
+// Tracks one registration token per (element, purpose), so a button that is
+// re-added or re-processed never collects duplicate callbacks. Elements are
+// held in an IdentityCache and only by Ref.
+template <typename Ref, typename Token>
+class CallbackRegistry {
+public:
+    // Registrations left behind by a dead element under a recycled key are
+    // forgotten here.
+    template <typename IsSame>
+    bool Contains(const void* key, CallbackPurpose purpose, IsSame isSame) {
+        auto* entry = m_elements.Find(key);
+        if (!entry) return false;
+        if (!isSame(entry->ref)) {
+            m_elements.Erase(key);
+            return false;
+        }
+        return entry->value.mask & Bit(purpose);
+    }
+
+    template <typename IsAlive>
+    void Add(const void* key, CallbackPurpose purpose, Ref ref, Token token,
+             IsAlive isAlive) {
+        auto* entry = m_elements.Find(key);
+        if (!entry) {
+            entry = &m_elements.Store(key, std::move(ref), {}, isAlive);
+        } else {
+            entry->ref = std::move(ref);
+        }
+        entry->value.mask |= Bit(purpose);
+        entry->value.tokens[static_cast<size_t>(purpose)] = token;
+    }
+
+    // Calls unregister(ref, purpose, token) for every live registration.
+    template <typename Unregister>
+    void Clear(Unregister unregister) {
+        m_elements.ForEach([&](const void*, auto& entry) {
+            for (size_t i = 0; i < kPurposeCount; i++) {
+                if (entry.value.mask & (1u << i)) {
+                    unregister(entry.ref, static_cast<CallbackPurpose>(i),
+                               entry.value.tokens[i]);
+                }
+            }
+        });
+        m_elements.Clear();
+    }
+
+    // Calls f(ref) once for every element with a registration.
+    template <typename F>
+    void ForEachElement(F f) {
+        m_elements.ForEach([&](const void*, auto& entry) { f(entry.ref); });
+    }
+
+    // Forgets the registrations of elements that are gone; their callbacks
+    // went with them.
+    template <typename IsAlive>
+    size_t Purge(IsAlive isAlive) {
+        return m_elements.Purge(isAlive);
+    }
+
+    size_t LiveCount() {
+        size_t live = 0;
+        m_elements.ForEach([&](const void*, auto& entry) {
+            live += std::popcount(entry.value.mask);
+        });
+        return live;
+    }
+
+    size_t ElementCount() const { return m_elements.Size(); }
+    size_t Bytes() const { return m_elements.Bytes(); }
+
+private:
+    static constexpr size_t kPurposeCount = static_cast<size_t>(CallbackPurpose::Count);
+
+    static unsigned Bit(CallbackPurpose purpose) {
+        return 1u << static_cast<unsigned>(purpose);
+    }
+
+    struct Registrations {
+        Token tokens[kPurposeCount]{};
+        unsigned mask = 0;
+    };
+
+    IdentityCache<Ref, Registrations> m_elements;
+};
+
+// ============================================================================
+// Retry scheduler
+// ============================================================================
+
+enum class RetryOutcome {
+    Resolved,  // verdict known
+    Pending,   // still unknown, try again later
+    Gone,      // element destroyed
+};
+
+// Elements waiting for something to load, rechecked in one batched pass per
+// tick with exponential backoff: 16 ms, doubling up to 1 s, for at most 12
+// tries (about 7 s). Entries hold only a Ref (a weak reference), so
+// destroyed elements drop out on their next pass. Time is passed in as
+// milliseconds, which keeps the class independent of any clock.
+template <typename Ref>
+class RetryScheduler {
+public:
+    static constexpr uint64_t kInitialDelayMs = 16;
+    static constexpr uint64_t kMaxDelayMs = 1024;
+    static constexpr uint32_t kMaxAttempts = 12;
+    static constexpr uint64_t kIdle = UINT64_MAX;
+
+    // Schedules the first recheck of key, unless it's already scheduled.
+    // stamp is handed back when the entry leaves.
+    bool Add(const void* key, Ref ref, uint64_t nowMs, uint64_t stamp) {
+        if (!m_keys.insert(key).second) return false;
+        m_entries.push_back({key, std::move(ref), nowMs + kInitialDelayMs,
+                             kInitialDelayMs, 0, stamp});
+        return true;
+    }
+
+    // Time the earliest entry is due, or kIdle.
+    uint64_t NextDue() const {
+        uint64_t due = kIdle;
+        for (const auto& entry : m_entries) due = std::min(due, entry.due);
+        return due;
+    }
+
+    // Calls recheck(ref) for every entry due at nowMs, and done(stamp,
+    // outcome) for each one that leaves; entries out of attempts leave as
+    // Pending. recheck may Add new entries, which wait for the next pass.
+    template <typename Recheck, typename Done>
+    void Tick(uint64_t nowMs, Recheck&& recheck, Done&& done) {
+        size_t count = m_entries.size();
+        size_t kept = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (m_entries[i].due <= nowMs) {
+                RetryOutcome outcome = recheck(m_entries[i].ref);
+                Entry& entry = m_entries[i];
+                entry.attempts++;
+                if (outcome != RetryOutcome::Pending || entry.attempts >= kMaxAttempts) {
+                    m_keys.erase(entry.key);
+                    done(entry.stamp, outcome);
+                    continue;
+                }
+                entry.delay = std::min(entry.delay * 2, kMaxDelayMs);
+                entry.due = nowMs + entry.delay;
+            }
+            if (kept != i) m_entries[kept] = std::move(m_entries[i]);
+            kept++;
+        }
+        m_entries.erase(m_entries.begin() + kept, m_entries.begin() + count);
+    }
+
+    void Clear() {
+        m_entries.clear();
+        m_keys.clear();
+    }
+
+    size_t Size() const { return m_entries.size(); }
+
+    // Approximate memory held, counting a node per key.
+    size_t Bytes() const {
+        return m_entries.capacity() * sizeof(Entry) +
+               m_keys.bucket_count() * sizeof(void*) +
+               m_keys.size() * 2 * sizeof(void*);
+    }
+
+private:
+    struct Entry {
+        const void* key;
+        Ref ref;
+        uint64_t due;
+        uint64_t delay;
+        uint32_t attempts;
+        uint64_t stamp;
+    };
+
+    std::vector<Entry> m_entries;
+    std::unordered_set<const void*> m_keys;
+};
+
+// ============================================================================
+// Visual tree abstraction
+// ============================================================================
+
+// The button, separator and label logic below is written against a Tree type
+// instead of WinUI directly, so it can run over any tree that provides:
+//
+//   Node                        nullable, copyable element handle
+//   Weak                        non-owning reference to a Node
+//   Node Parent(Node)
+//   int ChildCount(Node)
+//   Node Child(Node, int)
+//   bool IsButton(Node)
+//   bool IsSeparator(Node)
+//   bool IsVisible(Node)
+//   void Collapse(Node)
+//   void RememberHidden(Node, bool separator)
+//                               record a collapse about to happen, so it
+//                               can be undone
+//   bool WasHidden(Node)        collapsed by us and not restored since
+//   void Restore(Node)          show a separator we collapsed again, and
+//                               forget it was hidden
+//   const void* Identity(Node)
+//   Weak MakeWeak(Node)
+//   Node Resolve(Weak)          null once the element is gone
+//   Classify(Node)              -> Classification, see ClassifyWithRules
+//   void ScheduleSeparatorCleanup(Node)
+//   void WatchHidden(Node)      re-hide if the app shows it again
+//   void WatchPending(Node, uint64_t addedAt)
+//                               re-check once the icon is loaded; addedAt is
+//                               the ReadTicks() of the button's Add event, or
+//                               0 if unknown
+//   Measure(Probe)              RAII timer for the enclosing scope
+//   void RecordSince(Probe, uint64_t start)
+//                               record the time since a ReadTicks() stamp
+//   void LogHidden(const wchar_t* reason, std::wstring_view detail)
+//                               reason is a string literal
+//   void TraceChildren(Node parent, const std::vector<SeparatorSlot>&)
+//                               snapshot of the children a separator
+//                               cleanup looked at
+//
+// The cached classification, callbacks, retries and settings reapply also
+// need:
+//
+//   Icon                        a Classification, see ClassifyWithRules
+//   Icon ClassifyUncached(Node) evaluate the current rules
+//   const RuleTable& Rules()    the current rules
+//   ButtonState<Tree>* State()  the calling window's state, or null
+//   void Watch(Node, CallbackPurpose)
+//                               register the purpose's callback, once
+//
+// XamlTree binds it to the WinUI 3 visual tree.
+struct SeparatorSlot;
+template <typename Tree>
+struct ButtonState;
+
+#ifndef ECBH_CORE_ONLY
+struct XamlTree {
+    using Node = mux::DependencyObject;
+    using Weak = winrt::weak_ref<mux::DependencyObject>;
+    using Icon = ButtonIcon;
+
+    static Node Parent(Node const& node) {
+        return muxm::VisualTreeHelper::GetParent(node);
+    }
+    static int ChildCount(Node const& node) {
+        return muxm::VisualTreeHelper::GetChildrenCount(node);
+    }
+    static Node Child(Node const& node, int index) {
+        return muxm::VisualTreeHelper::GetChild(node, index);
+    }
+    static bool IsButton(Node const& node) {
+        return static_cast<bool>(node.try_as<muxc::AppBarButton>());
+    }
+    static bool IsSeparator(Node const& node) {
+        return static_cast<bool>(node.try_as<muxc::AppBarSeparator>());
+    }
+    static bool IsVisible(Node const& node) {
+        auto element = node.try_as<mux::UIElement>();
+        return element && element.Visibility() == mux::Visibility::Visible;
+    }
+    static void Collapse(Node const& node) {
+        if (auto element = node.try_as<mux::UIElement>()) {
+            SetOwnVisibility(element, mux::Visibility::Collapsed);
+        }
+    }
+
+    // Visibility callbacks run synchronously inside the write, so this
+    // tells them the write is ours rather than the app's.
+    static inline thread_local bool t_ownVisibilityWrite = false;
+
+    static void SetOwnVisibility(mux::UIElement const& element, mux::Visibility visibility) {
+        t_ownVisibilityWrite = true;
+        try {
+            element.Visibility(visibility);
+        } catch (...) {}
+        t_ownVisibilityWrite = false;
+    }
+    static const void* Identity(Node const& node) {
+        return winrt::get_abi(node);
+    }
+    static Weak MakeWeak(Node const& node) {
+        return winrt::make_weak(node);
+    }
+    static Node Resolve(Weak const& weak) {
+        return weak.get();
+    }
+
+    static ButtonIcon Classify(Node const& node);
+    static void RememberHidden(Node const& node, bool separator);
+    static bool WasHidden(Node const& node);
+    static void Restore(Node const& node);
+    static void ScheduleSeparatorCleanup(Node const& node);
+    static void WatchHidden(Node const& node);
+    static void WatchPending(Node const& node, uint64_t addedAt);
+
+    static auto Measure(Probe probe) { return g_metrics.Measure(probe); }
+    static void RecordSince(Probe probe, uint64_t start) { g_metrics.RecordSince(probe, start); }
+    static void LogHidden(const wchar_t* reason, std::wstring_view detail) {
+        LogHot<LogLevel::Info>(reason, detail);
+    }
+    static void TraceChildren(Node const& parent, const std::vector<SeparatorSlot>& children);
+
+    static Icon ClassifyUncached(Node const& node);
+    static const RuleTable& Rules();
+    static ButtonState<XamlTree>* State();
+    static void Watch(Node const& node, CallbackPurpose purpose);
+};
+#endif  // ECBH_CORE_ONLY
+
+// Owning AppBarButton of each element a label walk already went through
+// (an empty Weak when there's none). A walk cut off by the depth limit only
+// proves there's no button within the levels it looked at, so each entry
+// records how many levels, from the element up, are known to hold none.
+template <typename Tree>
+struct OwnerMap {
+    static constexpr uint32_t kUnbounded = UINT32_MAX;  // owner found, or root reached
+
+    struct Owner {
+        typename Tree::Weak owner;
+        uint32_t checkedLevels = kUnbounded;
+    };
+
+    IdentityCache<typename Tree::Weak, Owner> owners;
+    uint64_t walks = 0;
+    uint64_t levels = 0;
+};
+
+// Depth-first walk of an existing tree, run in slices so it never holds
+// the UI thread for long. The stack only holds Weak references, so parts of
+// the tree removed between slices are skipped.
+template <typename Tree>
+class TreeScanner {
+public:
+    using Node = typename Tree::Node;
+
+    // The clock is read once every kClockStride nodes, so each slice makes
+    // progress however small its budget.
+    static constexpr size_t kClockStride = 16;
+
+    explicit TreeScanner(Node const& root) { m_stack.push_back(Tree::MakeWeak(root)); }
+
+    // Visits nodes until the walk is complete or clock() reaches deadline.
+    // visit(node) returns whether to descend into the node's children.
+    // Returns true once the walk is complete.
+    template <typename Clock, typename Visit>
+    bool Step(Clock&& clock, uint64_t deadline, Visit&& visit) {
+        for (size_t n = 1; !m_stack.empty(); n++) {
+            if (n % kClockStride == 0 && clock() >= deadline) break;
+
+            Node node = Tree::Resolve(m_stack.back());
+            m_stack.pop_back();
+            if (!node) continue;
+
+            visited++;
+            if (!visit(node)) continue;
+            for (int i = Tree::ChildCount(node); i-- > 0;) {
+                if (auto child = Tree::Child(node, i)) m_stack.push_back(Tree::MakeWeak(child));
+            }
+            peakStack = std::max(peakStack, m_stack.size());
+        }
+        slices++;
+        return m_stack.empty();
+    }
+
+    size_t visited = 0;
+    size_t slices = 0;
+    size_t peakStack = 0;
+
+private:
+    std::vector<typename Tree::Weak> m_stack;
+};
+
+// ============================================================================
+// Tree event queue
+// ============================================================================
+
+enum class TreeEventKind : uint8_t {
+    AppBarButton,
+    AppBarSeparator,
+    TextLabel,
+};
+
+struct TreeEvent {
+    InstanceHandle handle;
+    TreeEventKind kind;
+    uint64_t addedAt;  // ReadTicks() at an AppBarButton Add event, 0 otherwise
+};
+
+// The visual tree events of one burst in arrival order, each handle waiting
+// at most once. Handles are deduplicated through an open-addressed index
+// into the event array. Taken events stay in the array until Clear, so the
+// index needs no deletions: a handle found at a taken position can simply
+// be queued again. Slots carry the burst's generation, so Clear is O(1),
+// and the storage is kept for the next burst, so a burst allocates only
+// when it outgrows every earlier one.
+class TreeEventQueue {
+public:
+    // Returns false if the handle is already waiting.
+    bool Push(TreeEvent const& event) {
+        if ((m_events.size() + 1) * 2 > m_index.size()) {
+            Rehash(std::max<size_t>(64, m_index.size() * 2));
+        }
+        Slot& slot = SlotFor(event.handle);
+        if (Live(slot) && slot.position > m_head) return false;
+        m_events.push_back(event);
+        slot = {static_cast<uint32_t>(m_events.size()), m_generation};
+        return true;
+    }
+
+    // Takes the oldest waiting event. Events pushed while it's processed
+    // are taken later in the same burst.
+    bool Pop(TreeEvent& event) {
+        if (m_head == m_events.size()) return false;
+        event = m_events[m_head++];
+        return true;
+    }
+
+    size_t Depth() const { return m_events.size() - m_head; }
+    bool Empty() const { return m_head == m_events.size(); }
+
+    // Ends the burst, dropping anything still waiting.
+    void Clear() {
+        m_events.clear();
+        m_head = 0;
+        if (++m_generation == 0) {
+            std::fill(m_index.begin(), m_index.end(), Slot{});
+            m_generation = 1;
+        }
+    }
+
+    size_t Bytes() const {
+        return m_events.capacity() * sizeof(TreeEvent) + m_index.capacity() * sizeof(Slot);
+    }
+
+private:
+    struct Slot {
+        uint32_t position = 0;  // 1-based index into m_events
+        uint32_t generation = 0;
+    };
+
+    static size_t Hash(InstanceHandle handle) {
+        return static_cast<size_t>((static_cast<uint64_t>(handle) * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    bool Live(Slot const& slot) const { return slot.generation == m_generation; }
+
+    // The handle's slot, or the empty slot ending its probe chain.
+    Slot& SlotFor(InstanceHandle handle) {
+        for (size_t i = Hash(handle) & m_mask;; i = (i + 1) & m_mask) {
+            Slot& slot = m_index[i];
+            if (!Live(slot) || m_events[slot.position - 1].handle == handle) return slot;
+        }
+    }
+
+    // Later events of a re-queued handle overwrite its earlier slot.
+    void Rehash(size_t capacity) {
+        m_index.assign(capacity, Slot{});
+        m_mask = capacity - 1;
+        m_generation = 1;
+        for (size_t i = 0; i < m_events.size(); i++) {
+            SlotFor(m_events[i].handle) = {static_cast<uint32_t>(i + 1), m_generation};
+        }
+    }
+
+    std::vector<TreeEvent> m_events;
+    size_t m_head = 0;
+    std::vector<Slot> m_index;
+    size_t m_mask = 0;
+    uint32_t m_generation = 1;
+};
+
+// ============================================================================
+// Per-window button state
+// ============================================================================
+
+struct HiddenElement {
+    bool separator;
+};
+
+// What the button logic keeps per window. The binding derives its per-UI
+// thread state from this and hands it out through Tree::State(). Nothing in
+// it refers to another window, so closing a window frees it as a whole.
+template <typename Tree>
+struct ButtonState {
+    using Weak = typename Tree::Weak;
+
+    CallbackRegistry<Weak, int64_t> callbacks;
+
+    OwnerMap<Tree> ownerMap;
+
+    // Button verdicts, valid while the properties the rules use are unchanged.
+    // Holds every button classified so far, whatever the rules, so a settings
+    // change can evaluate them all again.
+    IdentityCache<Weak, typename Tree::Icon> verdicts;
+
+    // Buttons and separators this mod collapsed, so a settings change can
+    // release the ones no longer hidden.
+    IdentityCache<Weak, HiddenElement> hidden;
+
+    // ReadTicks() at the Add event of each button waiting for its icon,
+    // until it's hidden
+    IdentityCache<Weak, uint64_t> addedAt;
+
+    // Buttons whose icon hasn't loaded yet (stamp: ReadTicks() when found)
+    RetryScheduler<Weak> retries;
+    uint64_t retriesExpired = 0;
+
+    // Table entries for elements the window tracks, all held by weak
+    // reference, and the memory behind them.
+    size_t TrackedElements() const {
+        return callbacks.ElementCount() + verdicts.Size() + hidden.Size() + addedAt.Size() +
+               ownerMap.owners.Size() + retries.Size();
+    }
+
+    size_t TrackedBytes() const {
+        return callbacks.Bytes() + verdicts.Bytes() + hidden.Bytes() + addedAt.Bytes() +
+               ownerMap.owners.Bytes() + retries.Bytes();
+    }
+
+    // Drops the entries of elements that are gone from every table, in one
+    // batch. Returns how many were dropped. The retry scheduler drops its
+    // own as they come due.
+    size_t PurgeExpired() {
+        auto isAlive = [](const Weak& ref) { return static_cast<bool>(Tree::Resolve(ref)); };
+        return callbacks.Purge(isAlive) + verdicts.Purge(isAlive) + hidden.Purge(isAlive) +
+               addedAt.Purge(isAlive) + ownerMap.owners.Purge(isAlive);
+    }
+};
+
+#ifndef ECBH_CORE_ONLY
+// ============================================================================
+// UI thread state
+// ============================================================================
+
+// Visual tree events are raised on the UI thread that owns the element, and
+// the element can only be touched from there, so each Explorer UI thread
+// gets its own state. It's only ever touched from its own thread and needs
+// no locking. Every File Explorer window (with all its tabs) runs on a
+// thread of its own, so this is also the per-window state: work for one
+// window never looks at another's, and closing the window frees it at once.
+struct UiThreadState : ButtonState<XamlTree> {
+    DWORD threadId = 0;
+    winrt::Microsoft::UI::Dispatching::DispatcherQueue dispatcher{nullptr};
+    winrt::event_token shutdownToken{};
+
+    // Parents with a separator cleanup pass already queued
+    std::unordered_set<const void*> dirtySeparatorParents;
+
+    // Timer for the retries of buttons whose icon hasn't loaded yet
+    winrt::Microsoft::UI::Dispatching::DispatcherQueueTimer retryTimer{nullptr};
+    winrt::event_token retryTickToken{};
+    uint64_t retryTimerDue = 0;  // 0 while stopped
+
+    // Scan of the tree that existed before the TAP was injected
+    bool scanChecked = false;
+    std::unique_ptr<TreeScanner<XamlTree>> scanner;
+    uint64_t scanStart = 0;  // ReadTicks()
+    uint64_t scanBusyTicks = 0;
+    uint64_t scanLongestSliceTicks = 0;
+
+    // Pending visual tree events
+    TreeEventQueue events;
+    bool drainScheduled = false;
+    TypeNameClassifier typeClassifier;
+
+    // Stats for the current burst, logged once it's drained
+    size_t peakDepth = 0;
+    size_t burstEvents = 0;
+    size_t burstBatches = 0;
+};
+
+std::mutex g_uiThreadStatesMutex;
+std::unordered_map<DWORD, std::unique_ptr<UiThreadState>> g_uiThreadStates;
+thread_local UiThreadState* t_uiThreadState;
+
+// Verdict cache totals of released windows, for the summary logged on unload
+std::atomic<uint64_t> g_verdictHits;
+std::atomic<uint64_t> g_verdictMisses;
+std::atomic<uint64_t> g_verdictInvalidations;
+
+// Frees the state of a UI thread whose dispatcher shut down, i.e. whose
+// window closed. Its elements are gone, so there's nothing to unregister.
+static void ReleaseUiThreadState(DWORD threadId) {
+    std::unique_ptr<UiThreadState> state;
+    {
+        std::lock_guard lock(g_uiThreadStatesMutex);
+        auto it = g_uiThreadStates.find(threadId);
+        if (it == g_uiThreadStates.end()) return;
+        state = std::move(it->second);
+        g_uiThreadStates.erase(it);
+    }
+    if (t_uiThreadState == state.get()) t_uiThreadState = nullptr;
+    g_verdictHits.fetch_add(state->verdicts.hits, std::memory_order_relaxed);
+    g_verdictMisses.fetch_add(state->verdicts.misses, std::memory_order_relaxed);
+    g_verdictInvalidations.fetch_add(state->verdicts.invalidations, std::memory_order_relaxed);
+    if (LogEnabled<LogLevel::Verbose>()) {
+        Wh_Log(L"Window thread %u: released %zu tracked elements, %zu bytes",
+               threadId, state->TrackedElements(), state->TrackedBytes());
+    }
+}
+
+// Returns the state of the calling thread, or nullptr if it has no dispatcher
+// or the mod is unloading.
+static UiThreadState* GetUiThreadState() {
+    if (t_uiThreadState) return t_uiThreadState;
+    if (g_disabled) return nullptr;
+
+    auto dispatcher = winrt::Microsoft::UI::Dispatching::DispatcherQueue::GetForCurrentThread();
+    if (!dispatcher) return nullptr;
+
+    DWORD threadId = GetCurrentThreadId();
+    std::lock_guard lock(g_uiThreadStatesMutex);
+    auto& state = g_uiThreadStates[threadId];
+    // A recycled thread id may leave a stale entry behind; start over.
+    state = std::make_unique<UiThreadState>();
+    state->threadId = threadId;
+    state->dispatcher = dispatcher;
+    try {
+        state->shutdownToken = dispatcher.ShutdownCompleted(
+            [threadId](auto const&, auto const&) { ReleaseUiThreadState(threadId); });
+    } catch (...) {}
+    t_uiThreadState = state.get();
+    return t_uiThreadState;
+}
+
+// Logs what the calling thread's window currently tracks.
+static void LogWindowCounts(UiThreadState* state) {
+    Wh_Log(L"Window thread %u: %zu callbacks, %zu verdicts, %zu hidden elements, "
+           L"%zu owner entries, %zu dirty separator parents, "
+           L"%zu pending icons (%llu given up)",
+           state->threadId, state->callbacks.LiveCount(), state->verdicts.Size(),
+           state->hidden.Size(), state->ownerMap.owners.Size(),
+           state->dirtySeparatorParents.size(), state->retries.Size(),
+           state->retriesExpired);
+    Wh_Log(L"Window thread %u: %zu tracked elements, %zu bytes",
+           state->threadId, state->TrackedElements(), state->TrackedBytes());
+}
+
+static mux::DependencyProperty PropertyForPurpose(CallbackPurpose purpose) {
+    switch (purpose) {
+    case CallbackPurpose::IconChanged:
+        return muxc::AppBarButton::IconProperty();
+    case CallbackPurpose::LabelChanged:
+        return muxc::AppBarButton::LabelProperty();
+    case CallbackPurpose::NameChanged:
+        return mux::Automation::AutomationProperties::NameProperty();
+    case CallbackPurpose::AutomationIdChanged:
+        return mux::Automation::AutomationProperties::AutomationIdProperty();
+    default:
+        return mux::UIElement::VisibilityProperty();
+    }
+}
+
+// Registers handler for the purpose's property unless the element already
+// has a callback for that purpose.
+template <typename Handler>
+static void RegisterCallbackOnce(mux::DependencyObject const& element,
+                                 CallbackPurpose purpose, Handler&& handler) {
+    UiThreadState* state = GetUiThreadState();
+    if (!state) {
+        element.RegisterPropertyChangedCallback(PropertyForPurpose(purpose),
+                                                std::forward<Handler>(handler));
+        return;
+    }
+
+    const void* key = winrt::get_abi(element);
+    auto isAlive = [](const winrt::weak_ref<mux::DependencyObject>& ref) {
+        return static_cast<bool>(ref.get());
+    };
+    bool registered = state->callbacks.Contains(key, purpose,
+        [key](const winrt::weak_ref<mux::DependencyObject>& ref) {
+            auto obj = ref.get();
+            return obj && winrt::get_abi(obj) == key;
+        });
+    if (registered) return;
+
+    int64_t token = element.RegisterPropertyChangedCallback(
+        PropertyForPurpose(purpose), std::forward<Handler>(handler));
+    state->callbacks.Add(key, purpose, winrt::make_weak(element), token, isAlive);
+}
+
+// Runs fn(state) on every UI thread through its dispatcher, and waits up to
+// timeoutMs in total for all of them to finish. A window may close in the
+// meantime, so the state is looked up again on its own thread.
+template <typename F>
+static void RunOnUiThreads(F fn, DWORD timeoutMs,
+                           winrt::Microsoft::UI::Dispatching::DispatcherQueuePriority priority =
+                               winrt::Microsoft::UI::Dispatching::DispatcherQueuePriority::High) {
+    std::vector<winrt::Microsoft::UI::Dispatching::DispatcherQueue> dispatchers;
+    {
+        std::lock_guard lock(g_uiThreadStatesMutex);
+        for (auto& [threadId, state] : g_uiThreadStates) {
+            dispatchers.push_back(state->dispatcher);
+        }
+    }
+
+    std::vector<HANDLE> events;
+    for (auto& dispatcher : dispatchers) {
+        HANDLE event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        if (!event) continue;
+        bool queued = dispatcher.TryEnqueue(priority, [fn, event]() {
+            try {
+                if (UiThreadState* state = t_uiThreadState) fn(state);
+            } catch (...) {}
+            SetEvent(event);
+        });
+        if (queued) {
+            events.push_back(event);
+        } else {
+            // Thread already gone, and its elements with it
+            CloseHandle(event);
+        }
+    }
+
+    ULONGLONG deadline = GetTickCount64() + timeoutMs;
+    for (HANDLE event : events) {
+        ULONGLONG now = GetTickCount64();
+        DWORD timeout = now < deadline ? (DWORD)(deadline - now) : 0;
+        if (WaitForSingleObject(event, timeout) == WAIT_OBJECT_0) {
+            CloseHandle(event);
+        } else {
+            // Still referenced by the queued lambda; leak it
+            Wh_Log(L"Timed out waiting for a UI thread");
+        }
+    }
+}
+
+// Unregisters every tracked callback, on each element's own thread, so no
+// callback outlives the mod.
+static void UnregisterAllCallbacks() {
+    RunOnUiThreads([](UiThreadState* state) {
+        if (LogEnabled<LogLevel::Verbose>()) LogWindowCounts(state);
+        try {
+            state->dispatcher.ShutdownCompleted(state->shutdownToken);
+            if (state->retryTimer) {
+                state->retryTimer.Stop();
+                state->retryTimer.Tick(state->retryTickToken);
+            }
+        } catch (...) {}
+        state->retries.Clear();
+        state->scanner.reset();
+        size_t count = state->callbacks.LiveCount();
+        state->callbacks.Clear([](const winrt::weak_ref<mux::DependencyObject>& ref,
+                                  CallbackPurpose purpose, int64_t token) {
+            if (auto obj = ref.get()) {
+                try {
+                    obj.UnregisterPropertyChangedCallback(PropertyForPurpose(purpose), token);
+                } catch (...) {}
+            }
+        });
+        if (LogEnabled<LogLevel::Verbose>()) {
+            Wh_Log(L"Unregistered %zu property callbacks", count);
+        }
+    }, 2000);
+}
+
+// Drains each UI thread's low-priority queue and frees its state there.
+// Drain, separator cleanup and scan work items are queued at Low priority;
+// a Low sentinel runs only after every one queued before it, and those all
+// bail out on g_disabled. The state (and the timer in it) is then released
+// on its own thread, not at DLL detach from the loader thread.
+static void ReleaseAllUiThreadStates() {
+    RunOnUiThreads([](UiThreadState* state) {
+        ReleaseUiThreadState(state->threadId);
+    }, 2000, winrt::Microsoft::UI::Dispatching::DispatcherQueuePriority::Low);
+
+    std::lock_guard lock(g_uiThreadStatesMutex);
+    if (!g_uiThreadStates.empty() && LogEnabled<LogLevel::Info>()) {
+        Wh_Log(L"%zu UI thread states left behind by threads that are gone",
+               g_uiThreadStates.size());
+    }
+}
+
+#endif  // ECBH_CORE_ONLY
+
+// ============================================================================
+// Separator layout
+// ============================================================================
+
+struct SeparatorSlot {
+    bool separator;
+    bool visible;
+};
+
+// Marks the visible separators that must be collapsed: leading, trailing and
+// consecutive ones. Pure function over a snapshot of the parent's children.
+static void ComputeSeparatorCollapse(const std::vector<SeparatorSlot>& children,
+                                     std::vector<bool>& collapse) {
+    collapse.assign(children.size(), false);
+
+    size_t lastSep = SIZE_MAX;
+    bool seenNonSep = false;
+
+    for (size_t i = 0; i < children.size(); i++) {
+        if (!children[i].visible) continue;
+
+        if (children[i].separator) {
+            if (!seenNonSep || lastSep != SIZE_MAX) {
+                // Leading or consecutive separator — collapse it
+                collapse[i] = true;
+            } else {
+                lastSep = i;
+            }
+        } else {
+            lastSep = SIZE_MAX;
+            seenNonSep = true;
+        }
+    }
+
+    // Trailing separator
+    if (lastSep != SIZE_MAX) {
+        collapse[lastSep] = true;
+    }
+}
+
+template <typename Tree>
+static void CleanupSeparatorsNow(typename Tree::Node parent) {
+    auto probe = Tree::Measure(Probe::CleanupSeparators);
+
+    int count = Tree::ChildCount(parent);
+
+    std::vector<typename Tree::Node> elements;
+    std::vector<SeparatorSlot> children;
+    elements.reserve(count);
+    children.reserve(count);
+
+    // Separators we collapsed count as visible, so the pass can also bring
+    // back the ones a button showing up again separates from the rest.
+    for (int i = 0; i < count; i++) {
+        auto child = Tree::Child(parent, i);
+        SeparatorSlot slot{};
+        if (child) {
+            slot.visible = Tree::IsVisible(child) ||
+                           (Tree::WasHidden(child) && Tree::IsSeparator(child));
+            slot.separator = slot.visible && Tree::IsSeparator(child);
+        }
+        elements.push_back(std::move(child));
+        children.push_back(slot);
+    }
+
+    Tree::TraceChildren(parent, children);
+
+    std::vector<bool> collapse;
+    ComputeSeparatorCollapse(children, collapse);
+
+    for (size_t i = 0; i < elements.size(); i++) {
+        if (!children[i].separator) continue;
+        bool ours = !Tree::IsVisible(elements[i]);
+        if (collapse[i] && !ours) {
+            Tree::RememberHidden(elements[i], true);
+            Tree::Collapse(elements[i]);
+        } else if (!collapse[i] && ours) {
+            Tree::Restore(elements[i]);
+        }
+    }
+}
+
+// ============================================================================
+// Button processing
+// ============================================================================
+
+template <typename Tree>
+static void HideButton(typename Tree::Node element, const wchar_t* reason,
+                       std::wstring_view uri) {
+    Tree::LogHidden(reason, uri);
+    Tree::RememberHidden(element, false);
+    Tree::Collapse(element);
+    Tree::ScheduleSeparatorCleanup(element);
+}
+
+// Re-classifies a button that may have changed and hides it if it matches.
+template <typename Tree>
+static IconVerdict RecheckButton(typename Tree::Node element, const wchar_t* reason) {
+    auto icon = Tree::Classify(element);
+    if (icon.verdict == IconVerdict::Hide) {
+        HideButton<Tree>(element, reason, icon.uri);
+    }
+    return icon.verdict;
+}
+
+// addedAt is the ReadTicks() of the button's Add event, or 0 if it's reached
+// some other way.
+template <typename Tree>
+static void ProcessAppBarButton(typename Tree::Node element, uint64_t addedAt = 0) {
+    if (!element) return;
+    auto probe = Tree::Measure(Probe::ProcessAppBarButton);
+
+    // The pre-render path, the initial scan and the button's own Add event
+    // can all reach the same button; only the first one hides it.
+    if (Tree::WasHidden(element)) return;
+
+    auto icon = Tree::Classify(element);
+
+    if (icon.verdict == IconVerdict::Hide) {
+        HideButton<Tree>(element, L"Hiding button", icon.uri);
+        if (addedAt) Tree::RecordSince(Probe::TimeToHide, addedAt);
+        Tree::WatchHidden(element);
+        return;
+    }
+
+    // Icon not loaded yet — watch for a deferred check
+    if (icon.verdict == IconVerdict::Pending) {
+        Tree::WatchPending(element, addedAt);
+    }
+}
+
+// Walks up from a label to its AppBarButton, at most 10 levels. Every level
+// passed on the way is remembered, so the next label in the same template
+// resolves on its first lookup and walks stop at known non-button chains.
+// Deep trees (navigation pane and file list icons) hit the depth limit; the
+// levels such a walk looked at are remembered as bounded, which is enough
+// for later walks reaching them at the same depth or deeper, e.g. from the
+// next item of the same list.
+template <typename Tree>
+static typename Tree::Node FindOwningButton(typename Tree::Node label,
+                                            OwnerMap<Tree>* map) {
+    using Node = typename Tree::Node;
+    using Map = OwnerMap<Tree>;
+    constexpr int kMaxDepth = 10;
+
+    if (map) map->walks++;
+
+    Node path[kMaxDepth];
+    int pathSize = 0;
+    Node owner{nullptr};
+    bool resolved = false;
+    // Levels known to hold no button above the end of the path, when it
+    // ended at a bounded cache entry
+    uint32_t checkedAbove = Map::kUnbounded;
+
+    Node current = Tree::Parent(label);
+    for (; pathSize < kMaxDepth && current; pathSize++) {
+        if (map) {
+            map->levels++;
+            const void* key = Tree::Identity(current);
+            if (auto* entry = map->owners.Find(key)) {
+                auto cached = Tree::Resolve(entry->ref);
+                uint32_t needed = static_cast<uint32_t>(kMaxDepth - pathSize);
+                if (cached && Tree::Identity(cached) == key &&
+                    entry->value.checkedLevels >= needed) {
+                    map->owners.hits++;
+                    owner = Tree::Resolve(entry->value.owner);
+                    checkedAbove = entry->value.checkedLevels;
+                    resolved = true;
+                    break;
+                }
+            }
+            map->owners.misses++;
+        }
+
+        if (Tree::IsButton(current)) {
+            owner = current;
+            resolved = true;
+            path[pathSize++] = current;
+            break;
+        }
+
+        path[pathSize] = current;
+        current = Tree::Parent(current);
+    }
+
+    // Reaching the root proves there's no owner at any depth.
+    if (!current) resolved = true;
+
+    if (map) {
+        auto isAlive = [](const typename Tree::Weak& ref) {
+            return static_cast<bool>(Tree::Resolve(ref));
+        };
+        auto weakOwner = owner ? Tree::MakeWeak(owner) : typename Tree::Weak{};
+        for (int i = 0; i < pathSize; i++) {
+            // path[i] is known free of buttons for the levels from it to the
+            // end of the path, plus whatever is known above that.
+            uint32_t checked = Map::kUnbounded;
+            if (!resolved) {
+                checked = static_cast<uint32_t>(pathSize - i);
+            } else if (checkedAbove != Map::kUnbounded) {
+                checked = static_cast<uint32_t>(pathSize - i) + checkedAbove;
+            }
+            map->owners.Store(Tree::Identity(path[i]), Tree::MakeWeak(path[i]),
+                              typename Map::Owner{weakOwner, checked}, isAlive);
+        }
+    }
 
-#include <atomic>
-#include <string>
-#include <vector>
+    return owner;
+}
 
-#undef GetCurrentTime
+// Pre-render path: a button's icon joins the tree while the button's
+// template is applied in its first layout pass, before anything is drawn.
+// Checking the owning button right then collapses it before it ever shows,
+// rather than a dispatcher tick later.
+template <typename Tree>
+static void ProcessIconAdded(typename Tree::Node icon, OwnerMap<Tree>* map) {
+    auto owner = FindOwningButton<Tree>(icon, map);
+    if (owner && Tree::IsVisible(owner)) {
+        ProcessAppBarButton<Tree>(owner);
+    }
+}
 
-#include <winrt/Microsoft.UI.Xaml.h>
-#include <winrt/Microsoft.UI.Xaml.Controls.h>
-#include <winrt/Microsoft.UI.Xaml.Media.h>
-#include <winrt/Microsoft.UI.Xaml.Media.Imaging.h>
-#include <winrt/Microsoft.UI.Dispatching.h>
-#include <winrt/Windows.Foundation.h>
+// What the initial scan does with each node: buttons and separators are
+// handled like newly added ones (a button's own template holds nothing to
+// hide), everything else is descended into. Buttons already collapsed were
+// handled by their Add event.
+template <typename Tree>
+static bool ScanNode(typename Tree::Node const& node) {
+    if (Tree::IsButton(node)) {
+        if (Tree::IsVisible(node)) ProcessAppBarButton<Tree>(node);
+        return false;
+    }
+    if (Tree::IsSeparator(node)) {
+        Tree::ScheduleSeparatorCleanup(node);
+        return false;
+    }
+    return true;
+}
 
 // ============================================================================
-// Globals
+// Callbacks, retries and settings changes
 // ============================================================================
 
-std::atomic<bool> g_initialized;
-bool g_disabled = false;
+// The properties a cached verdict depends on, each with the callback that
+// invalidates it.
+static constexpr std::pair<RuleField, CallbackPurpose> kWatchedFields[] = {
+    {RuleField::Icon, CallbackPurpose::IconChanged},
+    {RuleField::Label, CallbackPurpose::LabelChanged},
+    {RuleField::AutomationName, CallbackPurpose::NameChanged},
+    {RuleField::AutomationId, CallbackPurpose::AutomationIdChanged},
+};
 
-struct {
-    bool hideRotateLeft;
-    bool hideRotateRight;
-    bool hideSetAsDesktopBackground;
-} g_settings;
+// Returns the cached verdict while none of the properties the rules match on
+// change: each one the current rules use gets a callback that invalidates
+// the entry, so a button classified before its Label or automation name was
+// set is classified again once it is. Pending results are not cached: the
+// icon source can arrive without the Icon property itself changing.
+template <typename Tree>
+static typename Tree::Icon ClassifyButton(typename Tree::Node const& node) {
+    ButtonState<Tree>* state = Tree::State();
+    if (!state) return Tree::ClassifyUncached(node);
+
+    const void* key = Tree::Identity(node);
+    if (auto* entry = state->verdicts.Find(key)) {
+        auto cached = Tree::Resolve(entry->ref);
+        if (cached && Tree::Identity(cached) == key && entry->valid) {
+            state->verdicts.hits++;
+            return entry->value;
+        }
+    }
+    state->verdicts.misses++;
 
-namespace mux = winrt::Microsoft::UI::Xaml;
-namespace muxc = winrt::Microsoft::UI::Xaml::Controls;
-namespace muxm = winrt::Microsoft::UI::Xaml::Media;
-namespace wf = winrt::Windows::Foundation;
+    auto result = Tree::ClassifyUncached(node);
+    if (result.verdict == IconVerdict::Pending) return result;
+
+    state->verdicts.Store(key, Tree::MakeWeak(node), result,
+                          [](const typename Tree::Weak& ref) {
+                              return static_cast<bool>(Tree::Resolve(ref));
+                          });
+
+    const RuleTable& rules = Tree::Rules();
+    for (const auto& [field, purpose] : kWatchedFields) {
+        if (rules.UsesField(field)) Tree::Watch(node, purpose);
+    }
+    return result;
+}
+
+// A property some rule matches on was set or replaced: drops the cached
+// verdict and rechecks the button right away.
+template <typename Tree>
+static void OnButtonFieldChanged(typename Tree::Node const& button) {
+    if (ButtonState<Tree>* state = Tree::State()) {
+        state->verdicts.Invalidate(Tree::Identity(button));
+        state->verdicts.invalidations++;
+    }
+    if (!Tree::IsVisible(button) || Tree::WasHidden(button)) return;
+    if (RecheckButton<Tree>(button, L"Hiding on property change") == IconVerdict::Hide) {
+        Tree::WatchHidden(button);
+    }
+}
+
+// The app changed the Visibility of a button we hid (CallbackPurpose::ReHide).
+// That includes one a settings change has released since: it was left
+// collapsed, as only the app knows whether it should be showing, and this
+// is the app saying so.
+template <typename Tree>
+static void OnHiddenVisibilityChanged(typename Tree::Node const& button) {
+    auto probe = Tree::Measure(Probe::ReHideCallback);
+    if (!Tree::IsVisible(button)) return;
+    if (RecheckButton<Tree>(button, L"Re-hiding") != IconVerdict::Hide) {
+        Tree::ScheduleSeparatorCleanup(button);
+    }
+}
+
+// The app changed the Visibility of a button waiting for its icon
+// (CallbackPurpose::DeferredCheck). The icon often arrives as the button
+// becomes visible, so check it then too rather than waiting for the next
+// retry pass.
+template <typename Tree>
+static void OnPendingVisibilityChanged(typename Tree::Node const& button) {
+    if (!Tree::IsVisible(button)) return;
+    if (RecheckButton<Tree>(button, L"Deferred hiding") == IconVerdict::Hide) {
+        Tree::WatchHidden(button);
+    }
+}
+
+template <typename Tree>
+static RetryOutcome RetryPendingButton(typename Tree::Weak const& ref) {
+    auto node = Tree::Resolve(ref);
+    if (!node) return RetryOutcome::Gone;
+
+    // Already hidden through one of its callbacks
+    if (Tree::WasHidden(node)) return RetryOutcome::Resolved;
+
+    IconVerdict verdict = RecheckButton<Tree>(node, L"Deferred hiding");
+    if (verdict == IconVerdict::Pending) return RetryOutcome::Pending;
+    if (verdict == IconVerdict::Hide) Tree::WatchHidden(node);
+    return RetryOutcome::Resolved;
+}
 
-// Known SVG icon filenames (language-independent)
-static const wchar_t* ICON_ROTATE_LEFT = L"windows.rotate270.svg";
-static const wchar_t* ICON_ROTATE_RIGHT = L"windows.rotate90.svg";
-static const wchar_t* ICON_WALLPAPER = L"windows.setdesktopwallpaper.svg";
+// Rechecks the pending buttons due at nowMs. The caller re-arms its timer
+// for state.retries.NextDue() afterwards.
+template <typename Tree>
+static void RunDueRetries(ButtonState<Tree>& state, uint64_t nowMs) {
+    state.retries.Tick(nowMs,
+        [](const typename Tree::Weak& ref) {
+            try {
+                return RetryPendingButton<Tree>(ref);
+            } catch (...) {
+                return RetryOutcome::Gone;
+            }
+        },
+        [&state](uint64_t stamp, RetryOutcome outcome) {
+            if (outcome == RetryOutcome::Resolved) {
+                Tree::RecordSince(Probe::IconResolved, stamp);
+            } else if (outcome == RetryOutcome::Pending) {
+                state.retriesExpired++;
+            }
+        });
+}
+
+struct ReapplyCounts {
+    std::atomic<size_t> unhidden;
+    std::atomic<size_t> hidden;
+};
+
+// Re-evaluates every button this window has classified against the current
+// settings. The ones no longer matched are released but left collapsed: a
+// contextual button (rotate, set as background) may have been hidden by the
+// app since, with a write that changed nothing and so went unseen, and
+// showing it would bring back a dead button. The app's next Visibility
+// write shows it (OnHiddenVisibilityChanged). Newly matched buttons are
+// hidden right away.
+template <typename Tree>
+static void ReapplySettingsOnThread(ButtonState<Tree>& state, ReapplyCounts& counts) {
+    using Node = typename Tree::Node;
+
+    // The verdict cache has every classified button, whatever the rules
+    // were; the callbacks add the ones still waiting for their icon.
+    std::vector<Node> buttons;
+    state.verdicts.ForEach([&](const void*, auto& entry) {
+        if (auto node = Tree::Resolve(entry.ref)) buttons.push_back(node);
+    });
+    state.callbacks.ForEachElement([&](const typename Tree::Weak& ref) {
+        auto node = Tree::Resolve(ref);
+        if (!node) return;
+        auto* entry = state.verdicts.Find(Tree::Identity(node));
+        if (!entry || Tree::Resolve(entry->ref) != node) buttons.push_back(node);
+    });
+    state.verdicts.Clear();
+
+    std::vector<std::pair<const void*, Node>> hidden;
+    state.hidden.ForEach([&](const void* key, auto& entry) {
+        if (entry.value.separator) return;
+        if (auto node = Tree::Resolve(entry.ref)) hidden.push_back({key, node});
+    });
+
+    // A handful of command bars at most, so a linear search beats a set
+    std::vector<Node> parents;
+    for (const auto& [key, node] : hidden) {
+        if (ClassifyButton<Tree>(node).verdict == IconVerdict::Hide) continue;
+        state.hidden.Erase(key);
+        counts.unhidden++;
+        auto parent = Tree::Parent(node);
+        if (parent && std::find(parents.begin(), parents.end(), parent) == parents.end()) {
+            parents.push_back(parent);
+        }
+    }
+
+    for (const auto& button : buttons) {
+        if (Tree::WasHidden(button) || !Tree::IsButton(button)) continue;
+        if (RecheckButton<Tree>(button, L"Hiding after settings change") == IconVerdict::Hide) {
+            Tree::WatchHidden(button);
+            counts.hidden++;
+        }
+    }
+
+    // Lay the separators around the released buttons out again.
+    for (const auto& parent : parents) {
+        CleanupSeparatorsNow<Tree>(parent);
+    }
+}
 
 // ============================================================================
-// Icon matching
+// Window class prefilter
 // ============================================================================
 
-static std::wstring GetButtonSvgUri(mux::FrameworkElement element) {
-    try {
-        auto abb = element.try_as<muxc::AppBarButton>();
-        if (!abb) return L"";
-        auto icon = abb.Icon();
-        if (!icon) return L"";
-        auto imageIcon = icon.try_as<muxc::ImageIcon>();
-        if (!imageIcon) return L"";
-        auto source = imageIcon.Source();
-        if (!source) return L"";
-        auto svg = source.try_as<muxm::Imaging::SvgImageSource>();
-        if (!svg) return L"";
-        auto uri = svg.UriSource();
-        if (!uri) return L"";
-        return std::wstring(uri.AbsoluteUri());
-    } catch (...) {}
-    return L"";
+// Compares a class name against "CabinetWClass" without a system call,
+// ASCII case-insensitively like the window manager does.
+static bool IsTargetClassName(const wchar_t* className) {
+    constexpr wchar_t kTarget[] = L"CabinetWClass";
+    for (size_t i = 0;; i++) {
+        wchar_t a = className[i];
+        wchar_t b = kTarget[i];
+        if (a >= L'A' && a <= L'Z') a += L'a' - L'A';
+        if (b >= L'A' && b <= L'Z') b += L'a' - L'A';
+        if (a != b) return false;
+        if (!a) return true;
+    }
 }
 
-static bool ShouldHideByIcon(const std::wstring& svgUri) {
-    if (svgUri.empty()) return false;
-    if (g_settings.hideRotateLeft &&
-        svgUri.find(ICON_ROTATE_LEFT) != std::wstring::npos) return true;
-    if (g_settings.hideRotateRight &&
-        svgUri.find(ICON_ROTATE_RIGHT) != std::wstring::npos) return true;
-    if (g_settings.hideSetAsDesktopBackground &&
-        svgUri.find(ICON_WALLPAPER) != std::wstring::npos) return true;
-    return false;
+enum class ClassNameCheck {
+    Target,
+    NotTarget,
+    AskWindowManager,  // a class atom, which only GetClassName can resolve
+};
+
+// Decides what CreateWindowExW_Hook does with a window from its class name
+// argument alone, which is either a string or an atom in the low 16 bits.
+[[maybe_unused]] static ClassNameCheck PrefilterClassName(const wchar_t* className) {
+    if ((reinterpret_cast<uintptr_t>(className) >> 16) == 0) {
+        return ClassNameCheck::AskWindowManager;
+    }
+    return IsTargetClassName(className) ? ClassNameCheck::Target : ClassNameCheck::NotTarget;
 }
 
 // ============================================================================
-// Button processing
+// TAP connection search
+// ============================================================================
+
+struct ConnectionSearchResult {
+    HRESULT hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+    int index = 0;
+    int attempts = 0;
+};
+
+// Tries the index that worked last time first, then 1..maxIndex in order
+// until tryConnect(index) returns anything but ERROR_NOT_FOUND. The
+// remembered index is only accepted if it actually succeeds.
+template <typename TryConnect>
+static ConnectionSearchResult FindDiagConnection(int lastIndex, int maxIndex,
+                                                 TryConnect tryConnect) {
+    ConnectionSearchResult result;
+
+    if (lastIndex >= 1 && lastIndex <= maxIndex) {
+        result.attempts++;
+        HRESULT hr = tryConnect(lastIndex);
+        if (SUCCEEDED(hr)) {
+            result.hr = hr;
+            result.index = lastIndex;
+            return result;
+        }
+    }
+
+    for (int i = 1; i <= maxIndex; i++) {
+        if (i == lastIndex) continue;
+        result.attempts++;
+        result.hr = tryConnect(i);
+        if (result.hr != HRESULT_FROM_WIN32(ERROR_NOT_FOUND)) {
+            result.index = i;
+            break;
+        }
+    }
+
+    return result;
+}
+
+#ifndef ECBH_CORE_ONLY
+// ============================================================================
+// WinUI binding
 // ============================================================================
 
-static void CleanupSeparators(mux::FrameworkElement element) {
-    auto parent = muxm::VisualTreeHelper::GetParent(element);
+// Threads of the Explorer windows that already existed as the TAP was
+// injected. Each is taken out by its first tree event, so windows opened
+// later, even on the same threads, are never walked again.
+std::mutex g_scanThreadIdsMutex;
+std::unordered_set<DWORD> g_scanThreadIds;
+
+static bool TakeScanThread(DWORD threadId) {
+    std::lock_guard lock(g_scanThreadIdsMutex);
+    return g_scanThreadIds.erase(threadId) != 0;
+}
+
+// Marks the element's parent dirty. Every hide and separator add in the same
+// dispatcher tick shares a single low-priority cleanup pass per parent.
+void XamlTree::ScheduleSeparatorCleanup(Node const& element) {
+    auto parent = Parent(element);
     if (!parent) return;
-    int count = muxm::VisualTreeHelper::GetChildrenCount(parent);
 
-    mux::UIElement lastSep = nullptr;
-    bool seenNonSep = false;
+    UiThreadState* state = GetUiThreadState();
+    if (!state) {
+        CleanupSeparatorsNow<XamlTree>(parent);
+        return;
+    }
 
-    for (int i = 0; i < count; i++) {
-        auto child = muxm::VisualTreeHelper::GetChild(parent, i)
-                         .try_as<mux::UIElement>();
-        if (!child || child.Visibility() != mux::Visibility::Visible) continue;
+    const void* key = Identity(parent);
+    if (!state->dirtySeparatorParents.insert(key).second) return;
 
-        std::wstring cn(winrt::get_class_name(child));
-        if (cn.find(L"AppBarSeparator") != std::wstring::npos) {
-            if (!seenNonSep || lastSep) {
-                // Leading or consecutive separator — collapse it
-                child.Visibility(mux::Visibility::Collapsed);
-            } else {
-                lastSep = child;
-            }
-        } else {
-            lastSep = nullptr;
-            seenNonSep = true;
+    auto weakParent = MakeWeak(parent);
+    bool queued = state->dispatcher.TryEnqueue(
+        winrt::Microsoft::UI::Dispatching::DispatcherQueuePriority::Low,
+        [key, weakParent]() {
+        if (UiThreadState* state = t_uiThreadState) {
+            state->dirtySeparatorParents.erase(key);
         }
+        if (g_disabled) return;
+        if (auto parent = weakParent.get()) {
+            try {
+                CleanupSeparatorsNow<XamlTree>(parent);
+            } catch (...) {}
+        }
+    });
+
+    if (!queued) {
+        state->dirtySeparatorParents.erase(key);
+        CleanupSeparatorsNow<XamlTree>(parent);
     }
+}
 
-    // Trailing separator
-    if (lastSep) {
-        lastSep.Visibility(mux::Visibility::Collapsed);
+void XamlTree::TraceChildren(Node const& parent, const std::vector<SeparatorSlot>& children) {
+    if (!g_trace.Enabled()) return;
+    std::vector<uint8_t> flags;
+    flags.reserve(children.size());
+    for (const auto& slot : children) {
+        flags.push_back((slot.separator ? 1 : 0) | (slot.visible ? 2 : 0));
     }
+    g_trace.Children(TraceHandleOf(parent), flags.data(), (uint32_t)flags.size());
 }
 
-static void ReHideCallback(mux::DependencyObject const& sender, mux::DependencyProperty const&) {
+ButtonIcon XamlTree::Classify(Node const& node) {
+    return ClassifyButton<XamlTree>(node);
+}
+
+ButtonIcon XamlTree::ClassifyUncached(Node const& node) {
+    return ClassifyButtonUncached(node);
+}
+
+const RuleTable& XamlTree::Rules() {
+    return CurrentSettings().rules;
+}
+
+ButtonState<XamlTree>* XamlTree::State() {
+    return GetUiThreadState();
+}
+
+void XamlTree::RememberHidden(Node const& node, bool separator) {
+    UiThreadState* state = GetUiThreadState();
+    if (!state) return;
+
+    const void* key = Identity(node);
+    auto isAlive = [](const Weak& ref) { return static_cast<bool>(ref.get()); };
+    state->hidden.Store(key, MakeWeak(node), HiddenElement{separator}, isAlive);
+
+    if (separator) return;
+    if (auto* entry = state->addedAt.Find(key)) {
+        if (entry->ref.get() == node) {
+            g_metrics.RecordSince(Probe::TimeToHide, entry->value);
+        }
+        state->addedAt.Erase(key);
+    }
+}
+
+bool XamlTree::WasHidden(Node const& node) {
+    UiThreadState* state = GetUiThreadState();
+    if (!state) return false;
+    auto* entry = state->hidden.Find(Identity(node));
+    return entry && entry->ref.get() == node;
+}
+
+void XamlTree::Restore(Node const& node) {
+    if (UiThreadState* state = GetUiThreadState()) {
+        state->hidden.Erase(Identity(node));
+    }
+    if (auto element = node.try_as<mux::UIElement>()) {
+        SetOwnVisibility(element, mux::Visibility::Visible);
+    }
+}
+
+// Called when the Icon, Label or an automation property some rule matches
+// on is set or replaced.
+static void OnButtonFieldCallback(mux::DependencyObject const& sender, mux::DependencyProperty const&) {
     if (g_disabled) return;
-    auto el = sender.try_as<mux::FrameworkElement>();
-    if (!el || el.Visibility() == mux::Visibility::Collapsed) return;
-    std::wstring uri = GetButtonSvgUri(el);
-    if (ShouldHideByIcon(uri)) {
-        Wh_Log(L"Re-hiding: %s", uri.c_str());
-        el.Visibility(mux::Visibility::Collapsed);
-        CleanupSeparators(el);
+    OnButtonFieldChanged<XamlTree>(sender);
+}
+
+static void ReHideCallback(mux::DependencyObject const& sender, mux::DependencyProperty const&) {
+    if (g_disabled || XamlTree::t_ownVisibilityWrite) return;
+    OnHiddenVisibilityChanged<XamlTree>(sender);
+}
+
+static void OnDeferredCheck(mux::DependencyObject const& sender, mux::DependencyProperty const&) {
+    if (g_disabled || XamlTree::t_ownVisibilityWrite) return;
+    OnPendingVisibilityChanged<XamlTree>(sender);
+}
+
+void XamlTree::Watch(Node const& node, CallbackPurpose purpose) {
+    switch (purpose) {
+    case CallbackPurpose::ReHide:
+        RegisterCallbackOnce(node, purpose, ReHideCallback);
+        break;
+    case CallbackPurpose::DeferredCheck:
+        RegisterCallbackOnce(node, purpose, OnDeferredCheck);
+        break;
+    default:
+        RegisterCallbackOnce(node, purpose, OnButtonFieldCallback);
+        break;
     }
 }
 
-static void HideButton(mux::FrameworkElement fe, const std::wstring& reason) {
-    Wh_Log(L"Hiding button: %s", reason.c_str());
-    fe.Visibility(mux::Visibility::Collapsed);
-    CleanupSeparators(fe);
-    fe.RegisterPropertyChangedCallback(mux::UIElement::VisibilityProperty(), ReHideCallback);
+void XamlTree::WatchHidden(Node const& node) {
+    Watch(node, CallbackPurpose::ReHide);
 }
 
-static void ProcessAppBarButton(mux::FrameworkElement element) {
-    if (!element) return;
+static void OnRetryTick();
 
-    std::wstring svgUri = GetButtonSvgUri(element);
+// Makes sure the retry timer fires when the earliest pending button is due.
+static void ArmRetryTimer(UiThreadState* state) {
+    uint64_t due = state->retries.NextDue();
+    if (due == RetryScheduler<XamlTree::Weak>::kIdle) return;
+    if (state->retryTimerDue && state->retryTimerDue <= due) return;
 
-    if (ShouldHideByIcon(svgUri)) {
-        HideButton(element, svgUri);
-        return;
+    if (!state->retryTimer) {
+        state->retryTimer = state->dispatcher.CreateTimer();
+        state->retryTimer.IsRepeating(false);
+        state->retryTickToken = state->retryTimer.Tick(
+            [](auto const&, auto const&) { OnRetryTick(); });
     }
 
-    // Icon not loaded yet — register visibility callback for deferred check
-    if (svgUri.empty()) {
-        element.RegisterPropertyChangedCallback(
-            mux::UIElement::VisibilityProperty(),
-            [](mux::DependencyObject const& sender, mux::DependencyProperty const&) {
-                if (g_disabled) return;
-                auto fe = sender.try_as<mux::FrameworkElement>();
-                if (!fe || fe.Visibility() != mux::Visibility::Visible) return;
-
-                std::wstring uri = GetButtonSvgUri(fe);
-
-                if (ShouldHideByIcon(uri)) {
-                    Wh_Log(L"Deferred hiding: %s", uri.c_str());
-                    fe.Visibility(mux::Visibility::Collapsed);
-                    CleanupSeparators(fe);
-                    fe.RegisterPropertyChangedCallback(
-                        mux::UIElement::VisibilityProperty(), ReHideCallback);
-                    return;
-                }
+    uint64_t now = GetTickCount64();
+    state->retryTimer.Stop();
+    state->retryTimer.Interval(std::chrono::milliseconds(due > now ? due - now : 0));
+    state->retryTimer.Start();
+    state->retryTimerDue = due;
+}
 
-                if (uri.empty()) {
-                    auto refFe = fe;
-                    fe.DispatcherQueue().TryEnqueue(
-                        winrt::Microsoft::UI::Dispatching::DispatcherQueuePriority::Low,
-                        [refFe]() {
-                        if (g_disabled) return;
-                        std::wstring u = GetButtonSvgUri(refFe);
-                        if (ShouldHideByIcon(u)) {
-                            Wh_Log(L"Layout-deferred hide: %s", u.c_str());
-                            refFe.Visibility(mux::Visibility::Collapsed);
-                            CleanupSeparators(refFe);
-                        }
-                    });
-                }
-            });
+static void OnRetryTick() {
+    UiThreadState* state = GetUiThreadState();
+    if (!state) return;
+    state->retryTimerDue = 0;
+    if (g_disabled) return;
+
+    RunDueRetries<XamlTree>(*state, GetTickCount64());
+    ArmRetryTimer(state);
+}
+
+void XamlTree::WatchPending(Node const& node, uint64_t addedAt) {
+    Watch(node, CallbackPurpose::DeferredCheck);
+    Watch(node, CallbackPurpose::IconChanged);
+
+    UiThreadState* state = GetUiThreadState();
+    if (!state) return;
+    if (addedAt) {
+        state->addedAt.Store(Identity(node), MakeWeak(node), addedAt, [](const Weak& ref) {
+            return static_cast<bool>(ref.get());
+        });
+    }
+    if (state->retries.Add(Identity(node), MakeWeak(node), GetTickCount64(), ReadTicks())) {
+        ArmRetryTimer(state);
+    }
+}
+
+// Initial scan slices run at low priority, so input and layout go first.
+static constexpr uint64_t kScanSliceBudgetNs = 1000000;
+
+static void ContinueInitialScan() {
+    UiThreadState* state = GetUiThreadState();
+    if (!state || !state->scanner || g_disabled) return;
+
+    uint64_t start = ReadTicks();
+    bool done;
+    {
+        auto probe = g_metrics.Measure(Probe::ScanSlice);
+        done = state->scanner->Step(ReadTicks, start + NsToTicks(kScanSliceBudgetNs),
+                                    ScanNode<XamlTree>);
+    }
+    uint64_t slice = ReadTicks() - start;
+    state->scanBusyTicks += slice;
+    state->scanLongestSliceTicks = std::max(state->scanLongestSliceTicks, slice);
+
+    if (!done) {
+        bool queued = state->dispatcher.TryEnqueue(
+            winrt::Microsoft::UI::Dispatching::DispatcherQueuePriority::Low,
+            ContinueInitialScan);
+        if (queued) return;
+        // The dispatcher is shutting down, so is the window.
+    }
+
+    if (LogEnabled<LogLevel::Verbose>()) {
+        const auto& scanner = *state->scanner;
+        Wh_Log(L"Initial scan of window thread %u: %zu nodes in %zu slices, "
+               L"%llu us total, %llu us busy, longest slice %llu us, peak stack %zu",
+               state->threadId, scanner.visited, scanner.slices,
+               TicksToNs(ReadTicks() - state->scanStart) / 1000,
+               TicksToNs(state->scanBusyTicks) / 1000,
+               TicksToNs(state->scanLongestSliceTicks) / 1000, scanner.peakStack);
+    }
+    state->scanner.reset();
+}
+
+// Starts scanning the calling thread's tree from the root above element.
+static void StartInitialScan(UiThreadState* state, XamlTree::Node element) {
+    if (!element) return;
+
+    while (auto parent = XamlTree::Parent(element)) element = parent;
+    state->scanner = std::make_unique<TreeScanner<XamlTree>>(element);
+    state->scanStart = ReadTicks();
+    state->dispatcher.TryEnqueue(
+        winrt::Microsoft::UI::Dispatching::DispatcherQueuePriority::Low,
+        ContinueInitialScan);
+}
+
+// ============================================================================
+// Settings hot-swap
+// ============================================================================
+
+static void ReapplySettings() {
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    auto counts = std::make_shared<ReapplyCounts>();
+    RunOnUiThreads([counts](UiThreadState* state) {
+        ReapplySettingsOnThread<XamlTree>(*state, *counts);
+    }, 2000);
+
+    QueryPerformanceCounter(&end);
+    if (LogEnabled<LogLevel::Info>()) {
+        Wh_Log(L"Settings applied in %lld us: %zu buttons unhidden, %zu hidden",
+               (end.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart,
+               counts->unhidden.load(), counts->hidden.load());
     }
 }
 
@@ -250,6 +3037,10 @@ private:
     HRESULT STDMETHODCALLTYPE OnElementStateChanged(InstanceHandle,
         VisualElementState, LPCWSTR) noexcept override { return S_OK; }
 
+    void QueueEvent(InstanceHandle handle, TreeEventKind kind, uint64_t addedAt = 0);
+    void DrainEvents();
+    void ProcessEvent(TreeEvent const& event);
+
     wf::IInspectable FromHandle(InstanceHandle handle) {
         wf::IInspectable obj;
         winrt::check_hresult(m_XamlDiagnostics->GetIInspectableFromHandle(
@@ -264,6 +3055,7 @@ VisualTreeWatcher::VisualTreeWatcher(winrt::com_ptr<IUnknown> site) :
     m_XamlDiagnostics(site.as<IXamlDiagnostics>())
 {
     Wh_Log(L"Constructing VisualTreeWatcher");
+    g_traceDiagnostics = m_XamlDiagnostics.get();
 
     HANDLE thread = CreateThread(
         nullptr, 0,
@@ -289,6 +3081,7 @@ VisualTreeWatcher::~VisualTreeWatcher() {
 
 void VisualTreeWatcher::UnadviseVisualTreeChange() {
     Wh_Log(L"UnadviseVisualTreeChange");
+    g_traceDiagnostics = nullptr;
     HRESULT hr = m_XamlDiagnostics.as<IVisualTreeService3>()->UnadviseVisualTreeChange(this);
     if (FAILED(hr)) {
         Wh_Log(L"UnadviseVisualTreeChange failed: %08X", hr);
@@ -296,53 +3089,51 @@ void VisualTreeWatcher::UnadviseVisualTreeChange() {
 }
 
 HRESULT VisualTreeWatcher::OnVisualTreeChange(
-    ParentChildRelation, VisualElement element, VisualMutationType mutationType) try
+    ParentChildRelation relation, VisualElement element, VisualMutationType mutationType) try
 {
+    if (g_trace.Enabled()) g_trace.TreeChange(relation, element, mutationType);
     if (g_disabled || mutationType != Add || !element.Type) return S_OK;
+    auto probe = g_metrics.Measure(Probe::TreeChange);
 
     std::wstring_view typeName(element.Type);
+    UiThreadState* state = GetUiThreadState();
+    if (state && !state->scanChecked) {
+        state->scanChecked = true;
+        if (TakeScanThread(state->threadId)) {
+            StartInitialScan(state, FromHandle(element.Handle).try_as<mux::DependencyObject>());
+        }
+    }
+    TreeTypeClass typeClass = state ? state->typeClassifier.Classify(typeName)
+                                    : ClassifyTypeNameUncached(typeName);
+
+    switch (typeClass) {
+    case TreeTypeClass::Irrelevant:
+        break;
 
     // Strategy 1: AppBarButton directly added
-    if (typeName.find(L"AppBarButton") != std::wstring_view::npos) {
-        try {
-            auto obj = FromHandle(element.Handle);
-            auto fe = obj.try_as<mux::FrameworkElement>();
-            if (fe) ProcessAppBarButton(fe);
-        } catch (...) {}
-        return S_OK;
-    }
+    case TreeTypeClass::AppBarButton:
+        QueueEvent(element.Handle, TreeEventKind::AppBarButton, ReadTicks());
+        break;
 
     // Strategy 2: AppBarSeparator added — clean up orphaned separators
-    if (typeName.find(L"AppBarSeparator") != std::wstring_view::npos) {
-        try {
-            auto obj = FromHandle(element.Handle);
-            auto fe = obj.try_as<mux::FrameworkElement>();
-            if (fe) CleanupSeparators(fe);
-        } catch (...) {}
-        return S_OK;
-    }
+    case TreeTypeClass::AppBarSeparator:
+        QueueEvent(element.Handle, TreeEventKind::AppBarSeparator);
+        break;
 
     // Strategy 3: TextLabel added — walk up to find AppBarButton
-    std::wstring_view elName(element.Name ? element.Name : L"");
-    if (elName == L"TextLabel" && typeName.find(L"TextBlock") != std::wstring_view::npos) {
-        try {
-            auto obj = FromHandle(element.Handle);
-            auto fe = obj.try_as<mux::FrameworkElement>();
-            if (fe) {
-                auto current = muxm::VisualTreeHelper::GetParent(fe);
-                for (int depth = 0; depth < 10 && current; depth++) {
-                    auto parentFe = current.try_as<mux::FrameworkElement>();
-                    if (parentFe) {
-                        std::wstring cn(winrt::get_class_name(parentFe));
-                        if (cn.find(L"AppBarButton") != std::wstring::npos) {
-                            ProcessAppBarButton(parentFe);
-                            break;
-                        }
-                    }
-                    current = muxm::VisualTreeHelper::GetParent(current);
-                }
-            }
-        } catch (...) {}
+    case TreeTypeClass::TextBlock:
+        if (element.Name && std::wstring_view(element.Name) == L"TextLabel") {
+            QueueEvent(element.Handle, TreeEventKind::TextLabel);
+        }
+        break;
+
+    // Strategy 4: a button's ImageIcon added — handled right away, before
+    // the button's first render
+    case TreeTypeClass::ImageIcon:
+        if (auto icon = FromHandle(element.Handle).try_as<mux::DependencyObject>()) {
+            ProcessIconAdded<XamlTree>(icon, state ? &state->ownerMap : nullptr);
+        }
+        break;
     }
 
     return S_OK;
@@ -353,6 +3144,99 @@ catch (...)
     return S_OK;
 }
 
+// Bursts of Add events (a new window or tab) are queued and handled in
+// bounded low-priority batches, with each handle processed at most once.
+static constexpr size_t kMaxEventBatch = 64;
+
+void VisualTreeWatcher::QueueEvent(InstanceHandle handle, TreeEventKind kind,
+                                   uint64_t addedAt) {
+    UiThreadState* state = GetUiThreadState();
+    if (!state) {
+        ProcessEvent({handle, kind, addedAt});
+        return;
+    }
+
+    if (!state->events.Push({handle, kind, addedAt})) return;
+    state->peakDepth = std::max(state->peakDepth, state->events.Depth());
+
+    if (state->drainScheduled) return;
+    state->drainScheduled = state->dispatcher.TryEnqueue(
+        winrt::Microsoft::UI::Dispatching::DispatcherQueuePriority::Low,
+        [self = get_strong()]() { self->DrainEvents(); });
+    if (!state->drainScheduled) {
+        DrainEvents();
+    }
+}
+
+void VisualTreeWatcher::DrainEvents() {
+    UiThreadState* state = GetUiThreadState();
+    if (!state || g_disabled) return;
+
+    TreeEvent event;
+    for (size_t i = 0; i < kMaxEventBatch && !g_disabled && state->events.Pop(event); i++) {
+        ProcessEvent(event);
+        state->burstEvents++;
+    }
+    state->burstBatches++;
+
+    if (!state->events.Empty() && !g_disabled) {
+        state->drainScheduled = state->dispatcher.TryEnqueue(
+            winrt::Microsoft::UI::Dispatching::DispatcherQueuePriority::Low,
+            [self = get_strong()]() { self->DrainEvents(); });
+        if (state->drainScheduled) return;
+        // The dispatcher is shutting down, so is the window; drop the rest.
+    }
+
+    // Elements from the previous burst that have gone since go in one batch.
+    size_t purged = state->PurgeExpired();
+
+    if (LogEnabled<LogLevel::Verbose>()) {
+        Wh_Log(L"Purged %zu expired elements", purged);
+        Wh_Log(L"Drained %zu events in %zu batches, peak queue depth %zu, "
+               L"type classifier %llu hits / %llu misses, "
+               L"owner walks %llu (%llu levels, %llu hits / %llu misses)",
+               state->burstEvents, state->burstBatches, state->peakDepth,
+               state->typeClassifier.hits, state->typeClassifier.misses,
+               state->ownerMap.walks, state->ownerMap.levels,
+               state->ownerMap.owners.hits, state->ownerMap.owners.misses);
+        LogWindowCounts(state);
+    }
+    state->events.Clear();
+    state->drainScheduled = false;
+    state->peakDepth = 0;
+    state->burstEvents = 0;
+    state->burstBatches = 0;
+}
+
+void VisualTreeWatcher::ProcessEvent(TreeEvent const& event) try {
+    auto probe = g_metrics.Measure(event.kind == TreeEventKind::AppBarButton    ? Probe::Strategy1
+                                   : event.kind == TreeEventKind::AppBarSeparator ? Probe::Strategy2
+                                                                                  : Probe::Strategy3);
+
+    auto element = FromHandle(event.handle).try_as<mux::DependencyObject>();
+    if (!element) return;
+
+    switch (event.kind) {
+    case TreeEventKind::AppBarButton:
+        ProcessAppBarButton<XamlTree>(element, event.addedAt);
+        break;
+
+    case TreeEventKind::AppBarSeparator:
+        XamlTree::ScheduleSeparatorCleanup(element);
+        break;
+
+    case TreeEventKind::TextLabel: {
+        UiThreadState* state = GetUiThreadState();
+        auto owner = FindOwningButton<XamlTree>(element, state ? &state->ownerMap : nullptr);
+        if (owner) {
+            ProcessAppBarButton<XamlTree>(owner);
+        }
+        break;
+    }
+    }
+}
+catch (...) {}
+
 // ============================================================================
 // TAP (Technical Access Provider) — COM class for XAML diagnostics
 // ============================================================================
@@ -440,7 +3324,11 @@ _Use_decl_annotations_ STDAPI DllCanUnloadNow(void) {
 
 using PFN_INITIALIZE_XAML_DIAGNOSTICS_EX = decltype(&InitializeXamlDiagnosticsEx);
 
+static constexpr int kMaxConnectionIndex = 10000;
+
 HRESULT InjectWindhawkTAP() noexcept {
+    auto probe = g_metrics.Measure(Probe::InjectTap);
+
     HMODULE module = GetCurrentModuleHandle();
     if (!module) return HRESULT_FROM_WIN32(GetLastError());
 
@@ -459,19 +3347,30 @@ HRESULT InjectWindhawkTAP() noexcept {
         GetProcAddress(wux, "InitializeXamlDiagnosticsEx"));
     if (!ixde) [[unlikely]] return HRESULT_FROM_WIN32(GetLastError());
 
-    // Try multiple connection names until one works
-    HRESULT hr;
-    for (int i = 0; i < 10000; i++) {
-        WCHAR connectionName[256];
-        wsprintf(connectionName, L"WinUIVisualDiagConnection%d", i + 1);
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
 
-        hr = ixde(connectionName, GetCurrentProcessId(), L"", location, CLSID_WindhawkTAP, nullptr);
-        if (hr != HRESULT_FROM_WIN32(ERROR_NOT_FOUND)) {
-            break;
-        }
+    // Try multiple connection names until one works
+    int lastIndex = Wh_GetIntValue(L"lastConnectionIndex", 0);
+    DWORD processId = GetCurrentProcessId();
+    ConnectionSearchResult result = FindDiagConnection(lastIndex, kMaxConnectionIndex,
+        [&](int index) {
+            WCHAR connectionName[256];
+            wsprintf(connectionName, L"WinUIVisualDiagConnection%d", index);
+            return ixde(connectionName, processId, L"", location, CLSID_WindhawkTAP, nullptr);
+        });
+
+    QueryPerformanceCounter(&end);
+    Wh_Log(L"TAP connection search: index %d (last %d), %d attempts, %lld us",
+           result.index, lastIndex, result.attempts,
+           (end.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart);
+
+    if (SUCCEEDED(result.hr) && result.index != lastIndex) {
+        Wh_SetIntValue(L"lastConnectionIndex", result.index);
     }
 
-    return hr;
+    return result.hr;
 }
 
 void InitializeSettingsAndTap() {
@@ -490,6 +3389,15 @@ void UninitializeSettingsAndTap() {
         g_visualTreeWatcher->UnadviseVisualTreeChange();
         g_visualTreeWatcher = nullptr;
     }
+
+    UnregisterAllCallbacks();
+    ReleaseAllUiThreadStates();
+
+    if (LogEnabled<LogLevel::Info>()) {
+        Wh_Log(L"Verdict cache: %llu hits, %llu misses, %llu invalidations",
+               g_verdictHits.load(), g_verdictMisses.load(),
+               g_verdictInvalidations.load());
+    }
 }
 
 // ============================================================================
@@ -502,6 +3410,10 @@ bool IsTargetWindow(HWND hWnd) {
     return _wcsicmp(className, L"CabinetWClass") == 0;
 }
 
+std::atomic<uint64_t> g_createWindowCalls;
+std::atomic<uint64_t> g_createWindowPrefiltered;
+std::atomic<uint64_t> g_createWindowAfterInject;
+
 using CreateWindowExW_t = decltype(&CreateWindowExW);
 CreateWindowExW_t CreateWindowExW_Original;
 
@@ -514,7 +3426,28 @@ HWND WINAPI CreateWindowExW_Hook(DWORD dwExStyle, LPCWSTR lpClassName,
         dwStyle, X, Y, nWidth, nHeight, hWndParent, hMenu, hInstance, lpParam);
     if (!hWnd) return hWnd;
 
-    if (IsTargetWindow(hWnd)) {
+    g_createWindowCalls.fetch_add(1, std::memory_order_relaxed);
+
+    // The TAP is process-wide; nothing left to do once it's injected.
+    if (g_initialized.load(std::memory_order_relaxed)) {
+        g_createWindowAfterInject.fetch_add(1, std::memory_order_relaxed);
+        return hWnd;
+    }
+
+    bool isTarget = false;
+    switch (PrefilterClassName(lpClassName)) {
+    case ClassNameCheck::Target:
+        isTarget = true;
+        break;
+    case ClassNameCheck::NotTarget:
+        g_createWindowPrefiltered.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case ClassNameCheck::AskWindowManager:
+        isTarget = IsTargetWindow(hWnd);
+        break;
+    }
+
+    if (isTarget) {
         Wh_Log(L"Explorer window: hwnd=%08X", (DWORD)(ULONG_PTR)hWnd);
         InitializeSettingsAndTap();
     }
@@ -525,14 +3458,84 @@ HWND WINAPI CreateWindowExW_Hook(DWORD dwExStyle, LPCWSTR lpClassName,
 // Settings
 // ============================================================================
 
+static bool ParseRuleField(std::wstring_view name, RuleField* field) {
+    static constexpr std::pair<const wchar_t*, RuleField> kFields[] = {
+        {L"icon", RuleField::Icon},
+        {L"automationName", RuleField::AutomationName},
+        {L"automationId", RuleField::AutomationId},
+        {L"label", RuleField::Label},
+        {L"type", RuleField::Type},
+    };
+    for (const auto& [fieldName, value] : kFields) {
+        if (name == fieldName) {
+            *field = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::wstring GetStringSetting(PCWSTR format, int index) {
+    PCWSTR value = Wh_GetStringSetting(format, index);
+    std::wstring result = value;
+    Wh_FreeStringSetting(value);
+    return result;
+}
+
 void LoadSettings() {
-    g_settings.hideRotateLeft = Wh_GetIntSetting(L"hideRotateLeft");
-    g_settings.hideRotateRight = Wh_GetIntSetting(L"hideRotateRight");
-    g_settings.hideSetAsDesktopBackground = Wh_GetIntSetting(L"hideSetAsDesktopBackground");
+    auto settings = std::make_unique<Settings>();
+    for (size_t i = 0; i < ARRAYSIZE(kBuiltinRules); i++) {
+        settings->builtinRules[i] = Wh_GetIntSetting(kBuiltinRules[i].setting);
+        if (settings->builtinRules[i]) {
+            settings->rules.AddBuiltin(i);
+        }
+    }
+
+    for (int i = 0;; i++) {
+        std::wstring field = GetStringSetting(L"rules[%d].field", i);
+        if (field.empty()) break;
+
+        HideRule rule;
+        if (!ParseRuleField(field, &rule.field)) {
+            Wh_Log(L"Rule %d: unknown field %s", i, field.c_str());
+            continue;
+        }
+        rule.value = GetStringSetting(L"rules[%d].value", i);
+        rule.scope = GetStringSetting(L"rules[%d].scope", i);
+        if (rule.value.empty()) continue;
+
+        settings->rules.Add(rule);
+        settings->customRules.push_back(std::move(rule));
+    }
+
+    Wh_Log(L"Settings: RotateLeft=%d RotateRight=%d Wallpaper=%d, %zu custom rules",
+            settings->builtinRules[0], settings->builtinRules[1],
+            settings->builtinRules[2], settings->customRules.size());
+
+    PCWSTR logLevel = Wh_GetStringSetting(L"logLevel");
+    std::wstring_view level = logLevel;
+    g_logLevel = level == L"error"     ? LogLevel::Error
+                 : level == L"verbose" ? LogLevel::Verbose
+                                       : LogLevel::Info;
+    Wh_FreeStringSetting(logLevel);
+    g_logSummarizeRepeats = Wh_GetIntSetting(L"summarizeRepeats");
 
-    Wh_Log(L"Settings: RotateLeft=%d RotateRight=%d Wallpaper=%d",
-            g_settings.hideRotateLeft, g_settings.hideRotateRight,
-            g_settings.hideSetAsDesktopBackground);
+    PCWSTR traceFile = Wh_GetStringSetting(L"traceFile");
+    settings->traceFile = traceFile;
+    Wh_FreeStringSetting(traceFile);
+
+    g_settings.Publish(std::move(settings));
+}
+
+void OpenTraceFile() {
+    const std::wstring& traceFile = CurrentSettings().traceFile;
+    if (traceFile.empty()) return;
+
+    if (g_trace.Open(traceFile.c_str())) {
+        Wh_Log(L"Tracing to %s", traceFile.c_str());
+    } else {
+        Wh_Log(L"Can't open trace file %s: %u", traceFile.c_str(), GetLastError());
+    }
 }
 
 // ============================================================================
@@ -559,9 +3562,15 @@ std::vector<HWND> GetExistingExplorerWindows() {
 
 BOOL Wh_ModInit() {
     Wh_Log(L">");
+    InitializeMetrics();
     LoadSettings();
     g_disabled = false;
 
+    if (!g_asyncLog.Start()) {
+        Wh_Log(L"Can't start the log thread, logging synchronously");
+    }
+    OpenTraceFile();
+
     Wh_SetFunctionHook((void*)CreateWindowExW,
                         (void*)CreateWindowExW_Hook,
                         (void**)&CreateWindowExW_Original);
@@ -573,6 +3582,12 @@ void Wh_ModAfterInit() {
     auto hWnds = GetExistingExplorerWindows();
     if (!hWnds.empty()) {
         Wh_Log(L"Found %zu existing Explorer windows", hWnds.size());
+        {
+            std::lock_guard lock(g_scanThreadIdsMutex);
+            for (HWND hWnd : hWnds) {
+                g_scanThreadIds.insert(GetWindowThreadProcessId(hWnd, nullptr));
+            }
+        }
         InitializeSettingsAndTap();
     }
 }
@@ -581,11 +3596,40 @@ void Wh_ModUninit() {
     Wh_Log(L">");
     g_disabled = true;
     UninitializeSettingsAndTap();
+    {
+        // Threads whose windows closed before sending a tree event.
+        std::lock_guard lock(g_scanThreadIdsMutex);
+        g_scanThreadIds.clear();
+    }
+    g_asyncLog.Stop();
+
+    // The trace writer thread records its writes into the metrics block, so
+    // it's joined before the block is unmapped.
+    g_trace.Close();
+
+    if (LogEnabled<LogLevel::Info>()) {
+        Wh_Log(L"CreateWindowExW hook: %llu calls, %llu rejected by prefilter, "
+               L"%llu after injection",
+               g_createWindowCalls.load(), g_createWindowPrefiltered.load(),
+               g_createWindowAfterInject.load());
+        LogMetricsSummary();
+    }
+    UninitializeMetrics();
 }
 
 BOOL Wh_ModSettingsChanged(BOOL* bReload) {
     Wh_Log(L"Settings changed");
+    std::wstring previousTraceFile = CurrentSettings().traceFile;
     LoadSettings();
-    *bReload = TRUE;
+
+    if (CurrentSettings().traceFile != previousTraceFile) {
+        g_trace.Close();
+        OpenTraceFile();
+    }
+
+    // Applied in place; the TAP and the visual tree watcher stay attached.
+    ReapplySettings();
+    *bReload = FALSE;
     return TRUE;
-}
\ No newline at end of file
+}
+#endif  // ECBH_CORE_ONLY
@@ -0,0 +1,210 @@
+// Checks the log ring's ordering, truncation, drop counting and repeat
+// summarizing, under contention too, and prints the cost of a log call at
+// an enabled and a disabled level.
+
+#include "check.h"
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+#include <chrono>
+#include <thread>
+
+namespace {
+
+struct RecordingSink {
+    std::vector<std::wstring> lines;
+    uint64_t dropped = 0;
+
+    void Message(const wchar_t* message, std::wstring_view detail) {
+        lines.push_back(std::wstring(message) + L": " + std::wstring(detail));
+    }
+    void Repeated(unsigned count) {
+        lines.push_back(L"repeated " + std::to_wstring(count));
+    }
+    void Dropped(uint64_t count) { dropped += count; }
+};
+
+void TestOrderAndTruncation() {
+    LogRing ring;
+    RecordingSink sink;
+    for (int i = 0; i < 10; i++) ring.Push(L"Message", std::to_wstring(i));
+    std::wstring longDetail(LogRing::kMaxDetail + 50, L'x');
+    ring.Push(L"Long", longDetail);
+    ring.Drain(sink);
+
+    CHECK_EQ(sink.lines.size(), 11u);
+    for (int i = 0; i < 10; i++) {
+        CHECK(sink.lines[i] == L"Message: " + std::to_wstring(i));
+    }
+    CHECK(sink.lines[10] == L"Long: " + std::wstring(LogRing::kMaxDetail, L'x'));
+    CHECK_EQ(sink.dropped, 0u);
+}
+
+void TestDropsWhenFull() {
+    LogRing ring;
+    RecordingSink sink;
+    for (size_t i = 0; i < LogRing::kCapacity + 44; i++) {
+        ring.Push(L"Message", std::to_wstring(i));
+    }
+    ring.Drain(sink);
+    CHECK_EQ(sink.lines.size(), LogRing::kCapacity);
+    CHECK(sink.lines.back() == L"Message: " + std::to_wstring(LogRing::kCapacity - 1));
+    CHECK_EQ(sink.dropped, 44u);
+
+    // Reported once; the ring has room again.
+    ring.Push(L"Message", L"after");
+    ring.Drain(sink);
+    CHECK_EQ(sink.dropped, 44u);
+    CHECK(sink.lines.back() == L"Message: after");
+}
+
+void TestRepeats() {
+    LogRing ring;
+    RecordingSink sink;
+    g_logSummarizeRepeats = true;
+
+    for (int i = 0; i < 5; i++) ring.Push(L"Hiding button", L"windows.rotate90.svg");
+    ring.Push(L"Hiding button", L"windows.rotate270.svg");
+    ring.Drain(sink);
+    CHECK(sink.lines == std::vector<std::wstring>({
+        L"Hiding button: windows.rotate90.svg",
+        L"repeated 4",
+        L"Hiding button: windows.rotate270.svg",
+    }));
+
+    // A run at the end is summarized once a drain finds nothing new, and
+    // a run that resumes after that is summarized afresh.
+    sink.lines.clear();
+    for (int i = 0; i < 3; i++) ring.Push(L"Hiding button", L"windows.rotate270.svg");
+    ring.Drain(sink);
+    CHECK(sink.lines.empty());
+    ring.Drain(sink);
+    CHECK(sink.lines == std::vector<std::wstring>({L"repeated 3"}));
+
+    // Same detail, different message: not a repeat.
+    sink.lines.clear();
+    ring.Push(L"Re-hiding", L"windows.rotate270.svg");
+    ring.Drain(sink);
+    CHECK_EQ(sink.lines.size(), 1u);
+
+    g_logSummarizeRepeats = false;
+    sink.lines.clear();
+    for (int i = 0; i < 3; i++) ring.Push(L"Re-hiding", L"windows.rotate270.svg");
+    ring.Drain(sink);
+    ring.Drain(sink);
+    CHECK_EQ(sink.lines.size(), 3u);
+    g_logSummarizeRepeats = true;
+}
+
+void TestConcurrentProducers() {
+    constexpr int kProducers = 4;
+    constexpr int kPerProducer = 100000;
+    LogRing ring;
+    g_logSummarizeRepeats = false;
+
+    std::atomic<bool> done{false};
+    std::vector<int> lastSeen(kProducers, -1);
+    bool ordered = true;
+    size_t received = 0;
+    uint64_t dropped = 0;
+
+    struct ParsingSink {
+        std::vector<int>& lastSeen;
+        bool& ordered;
+        size_t& received;
+        uint64_t& dropped;
+
+        void Message(const wchar_t*, std::wstring_view detail) {
+            size_t colon = detail.find(L':');
+            int producer = std::stoi(std::wstring(detail.substr(0, colon)));
+            int seq = std::stoi(std::wstring(detail.substr(colon + 1)));
+            if (seq <= lastSeen[producer]) ordered = false;
+            lastSeen[producer] = seq;
+            received++;
+        }
+        void Repeated(unsigned) {}
+        void Dropped(uint64_t count) { dropped += count; }
+    } sink{lastSeen, ordered, received, dropped};
+
+    std::thread consumer([&] {
+        while (!done.load()) ring.Drain(sink);
+        ring.Drain(sink);
+    });
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++) {
+        producers.emplace_back([&ring, p] {
+            for (int i = 0; i < kPerProducer; i++) {
+                ring.Push(L"Message", std::to_wstring(p) + L":" + std::to_wstring(i));
+            }
+        });
+    }
+    for (auto& producer : producers) producer.join();
+    done = true;
+    consumer.join();
+
+    CHECK(ordered);
+    CHECK_EQ(received + dropped, static_cast<uint64_t>(kProducers) * kPerProducer);
+    std::printf("concurrent: %zu received, %llu dropped\n", received,
+                static_cast<unsigned long long>(dropped));
+    g_logSummarizeRepeats = true;
+}
+
+void TestLevels() {
+    g_logLevel = LogLevel::Info;
+    CHECK(LogEnabled<LogLevel::Error>());
+    CHECK(LogEnabled<LogLevel::Info>());
+    CHECK(!LogEnabled<LogLevel::Verbose>());
+    g_logLevel = LogLevel::Error;
+    CHECK(!LogEnabled<LogLevel::Info>());
+    g_logLevel = LogLevel::Verbose;
+    CHECK(LogEnabled<LogLevel::Verbose>());
+    g_logLevel = LogLevel::Info;
+}
+
+// What LogHot costs the calling thread, with a consumer draining the ring
+// as the log thread would.
+template <LogLevel level>
+double NsPerCall(LogRing& ring, int calls) {
+    const std::wstring_view detail = L"ms-appx:///Assets/windows.rotate90.svg";
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < calls; i++) {
+        if (LogEnabled<level>()) ring.Push(L"Hiding button", detail);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / calls;
+}
+
+void ReportCallCost() {
+    constexpr int kCalls = 1000000;
+    LogRing ring;
+    RecordingSink sink;
+    std::atomic<bool> done{false};
+    std::thread consumer([&] {
+        while (!done.load()) {
+            ring.Drain(sink);
+            sink.lines.clear();
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    });
+
+    g_logLevel = LogLevel::Info;
+    double enabled = NsPerCall<LogLevel::Info>(ring, kCalls);
+    double disabled = NsPerCall<LogLevel::Verbose>(ring, kCalls);
+    done = true;
+    consumer.join();
+
+    std::printf("log call: %.1f ns enabled, %.2f ns disabled (%llu dropped)\n", enabled,
+                disabled, static_cast<unsigned long long>(sink.dropped));
+}
+
+}  // namespace
+
+int main() {
+    TestOrderAndTruncation();
+    TestDropsWhenFull();
+    TestRepeats();
+    TestConcurrentProducers();
+    TestLevels();
+    ReportCallCost();
+    return g_failures;
+}
@@ -0,0 +1,853 @@
+// Offline performance regression check. Runs the mod's core (rule matcher,
+// type classifier, label owner walks, separator layout, identity caches,
+// callback registry, retry scheduler and log ring) and its Tree-generic
+// callback, retry and settings glue over BenchTree, the way the WinUI
+// binding drives them, on synthetic workloads and optionally a recorded
+// trace. Checks allocations per event against bench_budgets.txt, and events
+// per second and p99 latency per event too in optimized builds.
+//
+//   bench [--budgets FILE] [--json FILE] [--trace FILE]
+//
+// Results are printed as JSON, and also written to FILE with --json. The
+// exit code is the number of budgets missed.
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <new>
+#include <sstream>
+
+// ============================================================================
+// Allocation counting
+// ============================================================================
+
+static uint64_t g_allocations;
+
+// Out of line, so GCC doesn't see free() applied to the result of a
+// new-expression at each inlined call site (-Wmismatched-new-delete). The
+// array forms are replaced too, so every new-expression pairs with a
+// replaced delete.
+[[gnu::noinline]] void* operator new(size_t size) {
+    g_allocations++;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void* operator new[](size_t size) { return operator new(size); }
+
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete[](void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+// ============================================================================
+// Simulated tree
+// ============================================================================
+
+enum class NodeKind : uint8_t { Other, Button, Separator };
+
+struct BenchNode {
+    NodeKind kind = NodeKind::Other;
+    bool visible = true;
+    bool dirty = false;  // queued for separator cleanup
+    uint32_t generation = 1;
+    std::wstring_view type;
+    std::wstring_view name;
+    std::wstring_view label;
+    std::wstring icon;
+    BenchNode* parent = nullptr;
+    std::vector<BenchNode*> children;  // added ones; reserved up front
+    size_t childCapacity = 0;
+};
+
+struct BenchWeak {
+    BenchNode* node = nullptr;
+    uint32_t generation = 0;
+};
+
+using BenchIcon = Classification<std::wstring_view>;
+
+struct WindowState;
+
+// Binds the Tree-generic logic to BenchNode, the way XamlTree and the UI
+// thread state bind it to WinUI.
+struct BenchTree {
+    using Node = BenchNode*;
+    using Weak = BenchWeak;
+    using Icon = BenchIcon;
+
+    static Node Parent(Node node) { return node->parent; }
+    static int ChildCount(Node node) { return static_cast<int>(node->children.size()); }
+    static Node Child(Node node, int index) { return node->children[index]; }
+    static bool IsButton(Node node) { return node->kind == NodeKind::Button; }
+    static bool IsSeparator(Node node) { return node->kind == NodeKind::Separator; }
+    static bool IsVisible(Node node) { return node->visible; }
+    static void Collapse(Node node) { node->visible = false; }
+    static const void* Identity(Node node) { return node; }
+    static Weak MakeWeak(Node node) { return {node, node->generation}; }
+    static Node Resolve(Weak const& weak) {
+        return weak.node && weak.node->generation == weak.generation ? weak.node : nullptr;
+    }
+
+    static BenchIcon Classify(Node node);
+    static void RememberHidden(Node node, bool separator);
+    static bool WasHidden(Node node);
+    static void Restore(Node node);
+    static void ScheduleSeparatorCleanup(Node node);
+    static void WatchHidden(Node node);
+    static void WatchPending(Node node, uint64_t addedAt);
+
+    // Each event is timed as a whole instead.
+    struct NoTimer {
+        ~NoTimer() {}
+    };
+    static NoTimer Measure(Probe) { return {}; }
+    static void RecordSince(Probe, uint64_t) {}
+    static void LogHidden(const wchar_t* reason, std::wstring_view detail) {
+        if (LogEnabled<LogLevel::Info>()) log.Push(reason, detail);
+    }
+    static void TraceChildren(Node, const std::vector<SeparatorSlot>&) {}
+
+    static BenchIcon ClassifyUncached(Node node);
+    static const RuleTable& Rules() { return *rules; }
+    static ButtonState<BenchTree>* State();
+    static void Watch(Node node, CallbackPurpose purpose);
+
+    static inline WindowState* state;
+    static inline const RuleTable* rules;
+    static inline LogRing log;
+};
+
+bool IsAlive(const BenchWeak& weak) { return BenchTree::Resolve(weak) != nullptr; }
+
+struct WindowState : ButtonState<BenchTree> {
+    TypeNameClassifier typeClassifier;
+    std::vector<BenchNode*> dirtyParents;
+    int64_t nextToken = 0;
+    uint64_t nowMs = 1;
+};
+
+ButtonState<BenchTree>* BenchTree::State() {
+    return state;
+}
+
+bool HasCallback(BenchNode* node, CallbackPurpose purpose) {
+    auto weak = BenchTree::MakeWeak(node);
+    return BenchTree::state->callbacks.Contains(node, purpose, [&](const BenchWeak& ref) {
+        return ref.node == weak.node && ref.generation == weak.generation;
+    });
+}
+
+void BenchTree::Watch(Node node, CallbackPurpose purpose) {
+    if (HasCallback(node, purpose)) return;
+    WindowState& state = *BenchTree::state;
+    state.callbacks.Add(node, purpose, BenchTree::MakeWeak(node), ++state.nextToken, IsAlive);
+}
+
+bool HasAncestorNamed(BenchNode* node, std::wstring_view name) {
+    BenchNode* current = node->parent;
+    for (int depth = 0; depth < 32 && current; depth++) {
+        if (current->name == name) return true;
+        current = current->parent;
+    }
+    return false;
+}
+
+BenchIcon BenchTree::ClassifyUncached(Node node) {
+    return ClassifyWithRules<std::wstring_view>(*BenchTree::rules,
+        [&](RuleField field) -> std::wstring_view {
+            switch (field) {
+            case RuleField::Type: return node->type;
+            case RuleField::Label: return node->label;
+            case RuleField::Icon: return node->icon;
+            default: return {};
+            }
+        },
+        [&](std::wstring_view scope) { return HasAncestorNamed(node, scope); });
+}
+
+BenchIcon BenchTree::Classify(Node node) {
+    return ClassifyButton<BenchTree>(node);
+}
+
+void BenchTree::RememberHidden(Node node, bool separator) {
+    state->hidden.Store(node, MakeWeak(node), HiddenElement{separator}, IsAlive);
+    if (!separator) state->addedAt.Erase(node);
+}
+
+bool BenchTree::WasHidden(Node node) {
+    auto* entry = state->hidden.Find(node);
+    return entry && Resolve(entry->ref) == node;
+}
+
+void BenchTree::Restore(Node node) {
+    state->hidden.Erase(node);
+    node->visible = true;
+}
+
+void BenchTree::ScheduleSeparatorCleanup(Node node) {
+    BenchNode* parent = node->parent;
+    if (!parent || parent->dirty) return;
+    parent->dirty = true;
+    state->dirtyParents.push_back(parent);
+}
+
+void BenchTree::WatchHidden(Node node) {
+    Watch(node, CallbackPurpose::ReHide);
+}
+
+void BenchTree::WatchPending(Node node, uint64_t addedAt) {
+    Watch(node, CallbackPurpose::DeferredCheck);
+    Watch(node, CallbackPurpose::IconChanged);
+    if (addedAt) state->addedAt.Store(node, MakeWeak(node), addedAt, IsAlive);
+    state->retries.Add(node, MakeWeak(node), state->nowMs, addedAt);
+}
+
+// ============================================================================
+// Events, handled as the WinUI binding handles them
+// ============================================================================
+
+enum class EventKind : uint8_t {
+    Add,            // element added to the tree
+    Remove,         // element removed
+    AppVisibility,  // the app sets a button's Visibility
+    IconLoaded,     // a button's icon source arrives
+    Settings,       // the settings change
+    Tick,           // end of a dispatcher tick: separator cleanup, retries
+};
+
+struct Event {
+    EventKind kind;
+    BenchNode* node = nullptr;
+    bool visible = false;
+    const std::wstring* icon = nullptr;
+    const RuleTable* rules = nullptr;
+};
+
+void HandleAdd(BenchNode* node) {
+    WindowState& s = *BenchTree::state;
+    if (node->parent) node->parent->children.push_back(node);
+
+    switch (s.typeClassifier.Classify(node->type)) {
+    case TreeTypeClass::Irrelevant:
+        break;
+    case TreeTypeClass::AppBarButton:
+        ProcessAppBarButton<BenchTree>(node, s.nowMs);
+        break;
+    case TreeTypeClass::AppBarSeparator:
+        BenchTree::ScheduleSeparatorCleanup(node);
+        break;
+    case TreeTypeClass::TextBlock:
+        if (node->name == L"TextLabel") {
+            if (auto owner = FindOwningButton<BenchTree>(node, &s.ownerMap)) {
+                ProcessAppBarButton<BenchTree>(owner);
+            }
+        }
+        break;
+    case TreeTypeClass::ImageIcon:
+        ProcessIconAdded<BenchTree>(node, &s.ownerMap);
+        break;
+    }
+}
+
+void HandleRemove(BenchNode* node) {
+    if (BenchNode* parent = node->parent) {
+        auto& siblings = parent->children;
+        siblings.erase(std::remove(siblings.begin(), siblings.end(), node), siblings.end());
+    }
+    node->generation++;
+}
+
+// The app's Visibility write runs the element's callbacks in the order
+// they were registered, as WinUI does: a button's deferred check comes
+// before the re-hide callback it gains once hidden.
+void HandleAppVisibility(BenchNode* node, bool visible) {
+    node->visible = visible;
+    if (HasCallback(node, CallbackPurpose::DeferredCheck)) {
+        OnPendingVisibilityChanged<BenchTree>(node);
+    }
+    if (HasCallback(node, CallbackPurpose::ReHide)) {
+        OnHiddenVisibilityChanged<BenchTree>(node);
+    }
+}
+
+void HandleIconLoaded(BenchNode* node, const std::wstring& icon) {
+    node->icon = icon;
+    if (HasCallback(node, CallbackPurpose::IconChanged)) OnButtonFieldChanged<BenchTree>(node);
+}
+
+void HandleSettings(const RuleTable* rules) {
+    BenchTree::rules = rules;
+    ReapplyCounts counts{};
+    ReapplySettingsOnThread<BenchTree>(*BenchTree::state, counts);
+}
+
+void HandleTick() {
+    WindowState& s = *BenchTree::state;
+    s.nowMs += 16;
+    for (size_t i = 0; i < s.dirtyParents.size(); i++) {
+        BenchNode* parent = s.dirtyParents[i];
+        parent->dirty = false;
+        CleanupSeparatorsNow<BenchTree>(parent);
+    }
+    s.dirtyParents.clear();
+    RunDueRetries<BenchTree>(s, s.nowMs);
+}
+
+void Handle(const Event& event) {
+    switch (event.kind) {
+    case EventKind::Add: HandleAdd(event.node); break;
+    case EventKind::Remove: HandleRemove(event.node); break;
+    case EventKind::AppVisibility: HandleAppVisibility(event.node, event.visible); break;
+    case EventKind::IconLoaded: HandleIconLoaded(event.node, *event.icon); break;
+    case EventKind::Settings: HandleSettings(event.rules); break;
+    case EventKind::Tick: HandleTick(); break;
+    }
+}
+
+// ============================================================================
+// Workloads
+// ============================================================================
+
+constexpr std::wstring_view kGrid = L"Microsoft.UI.Xaml.Controls.Grid";
+constexpr std::wstring_view kBorder = L"Microsoft.UI.Xaml.Controls.Border";
+constexpr std::wstring_view kPresenter = L"Microsoft.UI.Xaml.Controls.ContentPresenter";
+constexpr std::wstring_view kCommandBar = L"Microsoft.UI.Xaml.Controls.CommandBar";
+constexpr std::wstring_view kButton = L"Microsoft.UI.Xaml.Controls.AppBarButton";
+constexpr std::wstring_view kSeparator = L"Microsoft.UI.Xaml.Controls.AppBarSeparator";
+constexpr std::wstring_view kTextBlock = L"Microsoft.UI.Xaml.Controls.TextBlock";
+constexpr std::wstring_view kImageIcon = L"Microsoft.UI.Xaml.Controls.ImageIcon";
+constexpr std::wstring_view kListItem = L"Microsoft.UI.Xaml.Controls.ListViewItem";
+
+// Command bar of an Explorer window with an image selected; an empty icon
+// is a separator.
+struct BarItem {
+    const wchar_t* icon;
+    const wchar_t* label;
+};
+constexpr BarItem kBarItems[] = {
+    {L"windows.new.svg", L"New"},
+    {nullptr, nullptr},
+    {L"windows.cut.svg", L"Cut"},
+    {L"windows.copy.svg", L"Copy"},
+    {L"windows.paste.svg", L"Paste"},
+    {L"windows.rename.svg", L"Rename"},
+    {L"windows.share.svg", L"Share"},
+    {L"windows.delete.svg", L"Delete"},
+    {nullptr, nullptr},
+    {L"windows.rotate270.svg", L"Rotate left"},
+    {L"windows.rotate90.svg", L"Rotate right"},
+    {L"windows.setdesktopwallpaper.svg", L"Set as background"},
+    {nullptr, nullptr},
+    {L"windows.sort.svg", L"Sort"},
+    {L"windows.view.svg", L"View"},
+    {L"windows.filter.svg", L"Filter"},
+    {nullptr, nullptr},
+    {L"windows.more.svg", L"See more"},
+};
+
+// Buttons the built-in rules hide
+bool IsContextual(const BarItem& item) {
+    return item.icon && (std::wcsstr(item.icon, L"rotate") || std::wcsstr(item.icon, L"wallpaper"));
+}
+
+struct Workload {
+    std::string name;
+    std::deque<BenchNode> nodes;
+    std::deque<std::wstring> strings;
+    std::vector<Event> events;
+    std::vector<BenchNode*> contextualButtons;
+    size_t expectedHidden = 0;  // buttons hidden once it has run
+
+    BenchNode* Node(BenchNode* parent, std::wstring_view type, std::wstring_view name = {}) {
+        BenchNode& node = nodes.emplace_back();
+        node.type = type;
+        node.name = name;
+        node.parent = parent;
+        node.icon.reserve(64);
+        if (parent) parent->childCapacity++;
+        return &node;
+    }
+
+    // Appends Add events for a subtree built with Node, in creation order,
+    // with a tick every kMaxEventBatch events as the drain would.
+    void AddAll(size_t firstNode) {
+        for (size_t i = firstNode; i < nodes.size(); i++) {
+            events.push_back({EventKind::Add, &nodes[i]});
+            if (events.size() % 64 == 0) events.push_back({EventKind::Tick});
+        }
+        events.push_back({EventKind::Tick});
+    }
+
+    void Reserve() {
+        for (auto& node : nodes) node.children.reserve(node.childCapacity);
+    }
+};
+
+// A command bar. With pendingIcons, the contextual buttons' icons arrive
+// a couple of ticks after the buttons.
+void BuildCommandBar(Workload& w, BenchNode* parent, bool pendingIcons,
+                     std::vector<std::pair<BenchNode*, const wchar_t*>>& late) {
+    auto* bar = w.Node(parent, kCommandBar, L"CommandBar");
+    auto* items = w.Node(w.Node(bar, kGrid, L"LayoutRoot"), kGrid, L"PrimaryItemsRoot");
+    for (const BarItem& item : kBarItems) {
+        if (!item.icon) {
+            w.Node(items, kSeparator)->kind = NodeKind::Separator;
+            continue;
+        }
+        auto* button = w.Node(items, kButton);
+        button->kind = NodeKind::Button;
+        button->label = item.label;
+        std::wstring uri = std::wstring(L"ms-appx:///Assets/Images/") + item.icon;
+        if (pendingIcons && IsContextual(item)) {
+            late.push_back({button, item.icon});
+        } else {
+            button->icon = uri;
+        }
+        if (IsContextual(item)) w.contextualButtons.push_back(button);
+        auto* root = w.Node(button, kGrid, L"Root");
+        auto* content = w.Node(w.Node(root, kBorder, L"Border"), kGrid, L"ContentRoot");
+        w.Node(w.Node(content, kPresenter, L"Content"), kImageIcon);
+        w.Node(content, kTextBlock, L"TextLabel");
+    }
+}
+
+// A list of items with an icon and a few text blocks each, like the
+// navigation pane or a folder's contents.
+void BuildList(Workload& w, BenchNode* parent, int count) {
+    auto* list = w.Node(parent, kGrid, L"ItemsHost");
+    for (int i = 0; i < count; i++) {
+        auto* item = w.Node(w.Node(list, kListItem), kGrid);
+        w.Node(w.Node(item, kBorder), kImageIcon);
+        for (int j = 0; j < 3; j++) w.Node(w.Node(item, kBorder), kTextBlock);
+    }
+}
+
+void AddIconLoads(Workload& w, const std::vector<std::pair<BenchNode*, const wchar_t*>>& late) {
+    w.events.push_back({EventKind::Tick});
+    w.events.push_back({EventKind::Tick});
+    for (auto& [button, icon] : late) {
+        w.strings.push_back(std::wstring(L"ms-appx:///Assets/Images/") + icon);
+        w.events.push_back({EventKind::IconLoaded, button, false, &w.strings.back()});
+    }
+    w.events.push_back({EventKind::Tick});
+}
+
+BenchNode* BuildWindow(Workload& w) {
+    std::vector<std::pair<BenchNode*, const wchar_t*>> late;
+    size_t first = w.nodes.size();
+    auto* root = w.Node(nullptr, kGrid, L"RootGrid");
+    BuildList(w, w.Node(root, kGrid, L"NavigationPane"), 30);
+    BuildCommandBar(w, w.Node(root, kGrid, L"CommandBarHost"), true, late);
+    BuildList(w, w.Node(root, kGrid, L"ContentHost"), 100);
+    w.AddAll(first);
+    AddIconLoads(w, late);
+    w.expectedHidden += 3;
+    return root;
+}
+
+RuleTable BuiltinRules() {
+    RuleTable rules;
+    for (size_t i = 0; i < std::size(kBuiltinRules); i++) rules.AddBuiltin(i);
+    return rules;
+}
+
+RuleTable AlternateRules() {
+    RuleTable rules;
+    rules.Add({RuleField::Icon, L"windows.setdesktopwallpaper.svg", L""});
+    rules.Add({RuleField::Label, L"Share", L""});
+    rules.Add({RuleField::Type, std::wstring(kButton), L"NoSuchPane"});
+    return rules;
+}
+
+const RuleTable g_builtinRules = BuiltinRules();
+const RuleTable g_alternateRules = AlternateRules();
+
+std::unique_ptr<Workload> OneWindow() {
+    auto w = std::make_unique<Workload>();
+    w->name = "one_window";
+    BuildWindow(*w);
+    return w;
+}
+
+// A window, then 50 tabs, each with its own command bar and folder view
+std::unique_ptr<Workload> FiftyTabs() {
+    auto w = std::make_unique<Workload>();
+    w->name = "fifty_tabs";
+    BenchNode* root = BuildWindow(*w);
+    for (int tab = 0; tab < 50; tab++) {
+        std::vector<std::pair<BenchNode*, const wchar_t*>> late;
+        size_t first = w->nodes.size();
+        auto* host = w->Node(root, kGrid, L"TabContent");
+        BuildCommandBar(*w, host, tab % 2 == 0, late);
+        BuildList(*w, host, 100);
+        w->AddAll(first);
+        AddIconLoads(*w, late);
+        w->expectedHidden += 3;
+    }
+    return w;
+}
+
+// Rapid selection changes: the app shows the contextual buttons when an
+// image is selected and collapses them when it isn't, and the mod hides
+// them again each time.
+std::unique_ptr<Workload> SelectionToggles() {
+    auto w = std::make_unique<Workload>();
+    w->name = "selection_toggles";
+    BuildWindow(*w);
+    for (int i = 0; i < 5000; i++) {
+        for (BenchNode* button : w->contextualButtons) {
+            w->events.push_back({EventKind::AppVisibility, button, i % 2 == 0});
+        }
+        w->events.push_back({EventKind::Tick});
+    }
+    return w;
+}
+
+// Settings flipping between the built-in rules and a set that keeps the
+// rotate buttons but hides Share, with a scoped rule that never matches.
+std::unique_ptr<Workload> SettingsChanges() {
+    auto w = std::make_unique<Workload>();
+    w->name = "settings_changes";
+    BuildWindow(*w);
+    for (int i = 0; i < 500; i++) {
+        const RuleTable* rules = i % 2 == 0 ? &g_alternateRules : &g_builtinRules;
+        w->events.push_back({EventKind::Settings, nullptr, false, nullptr, rules});
+        w->events.push_back({EventKind::Tick});
+    }
+    return w;
+}
+
+// ============================================================================
+// Recorded workload
+// ============================================================================
+
+class TraceReader {
+public:
+    explicit TraceReader(std::string data) : m_data(std::move(data)) {}
+
+    template <typename T>
+    bool Read(T& value) {
+        if (m_pos + sizeof(T) > m_data.size()) return false;
+        std::memcpy(&value, m_data.data() + m_pos, sizeof(T));
+        m_pos += sizeof(T);
+        return true;
+    }
+
+    // UTF-16 in the file; widened unit by unit.
+    bool ReadString(std::wstring& value) {
+        uint16_t length;
+        if (!Read(length) || m_pos + length * 2 > m_data.size()) return false;
+        value.resize(length);
+        for (uint16_t i = 0; i < length; i++) {
+            uint16_t unit = 0;
+            Read(unit);
+            value[i] = unit;
+        }
+        return true;
+    }
+
+    bool Skip(size_t bytes) {
+        if (m_pos + bytes > m_data.size()) return false;
+        m_pos += bytes;
+        return true;
+    }
+
+    bool AtEnd() const { return m_pos == m_data.size(); }
+
+private:
+    std::string m_data;
+    size_t m_pos = 0;
+};
+
+// Replays the tree events of a trace written by the mod's traceFile
+// setting, with the icon URIs it recorded, and a tick every 16 ms of
+// recorded time. Returns null if the file can't be read.
+std::unique_ptr<Workload> RecordedTrace(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return nullptr;
+    std::stringstream contents;
+    contents << file.rdbuf();
+    TraceReader reader(contents.str());
+
+    char magic[4];
+    uint32_t version;
+    uint64_t ticksPerSecond;
+    if (!reader.Read(magic) || std::memcmp(magic, "ECBT", 4) != 0 || !reader.Read(version) ||
+        version != kTraceVersion || !reader.Read(ticksPerSecond) || !ticksPerSecond) {
+        return nullptr;
+    }
+
+    auto w = std::make_unique<Workload>();
+    w->name = "trace";
+    std::unordered_map<uint64_t, BenchNode*> byHandle;
+    std::unordered_map<uint64_t, std::wstring> icons;
+    std::vector<std::pair<EventKind, uint64_t>> changes;
+    uint64_t lastTick = 0;
+
+    while (!reader.AtEnd()) {
+        uint8_t kind;
+        uint64_t ticks;
+        if (!reader.Read(kind) || !reader.Read(ticks)) return nullptr;
+
+        if (kind == static_cast<uint8_t>(TraceRecord::TreeChange)) {
+            uint8_t mutation;
+            uint64_t parent, child, handle;
+            uint32_t childIndex, numChildren;
+            std::wstring type, name;
+            if (!reader.Read(mutation) || !reader.Read(parent) || !reader.Read(child) ||
+                !reader.Read(childIndex) || !reader.Read(handle) || !reader.Read(numChildren) ||
+                !reader.ReadString(type) || !reader.ReadString(name)) {
+                return nullptr;
+            }
+            if (ticks - lastTick > ticksPerSecond / 60) {
+                if (lastTick) changes.push_back({EventKind::Tick, 0});
+                lastTick = ticks;
+            }
+            if (mutation == 0) {  // Add
+                w->strings.push_back(std::move(type));
+                std::wstring_view typeView = w->strings.back();
+                w->strings.push_back(std::move(name));
+                auto it = byHandle.find(parent);
+                BenchNode* node = w->Node(it != byHandle.end() ? it->second : nullptr,
+                                          typeView, w->strings.back());
+                if (typeView.find(L"AppBarButton") != std::wstring_view::npos) {
+                    node->kind = NodeKind::Button;
+                } else if (typeView.find(L"AppBarSeparator") != std::wstring_view::npos) {
+                    node->kind = NodeKind::Separator;
+                }
+                byHandle[handle] = node;
+                changes.push_back({EventKind::Add, handle});
+            } else if (byHandle.count(handle)) {
+                changes.push_back({EventKind::Remove, handle});
+            }
+        } else if (kind == static_cast<uint8_t>(TraceRecord::IconUri)) {
+            uint64_t element;
+            uint8_t verdict;
+            std::wstring uri;
+            if (!reader.Read(element) || !reader.Read(verdict) || !reader.ReadString(uri)) {
+                return nullptr;
+            }
+            if (!uri.empty() && !icons.count(element)) icons[element] = std::move(uri);
+        } else if (kind == static_cast<uint8_t>(TraceRecord::Children)) {
+            uint64_t parent;
+            uint32_t count;
+            if (!reader.Read(parent) || !reader.Read(count) || !reader.Skip(count)) {
+                return nullptr;
+            }
+        } else {
+            return nullptr;
+        }
+    }
+
+    // Icons are known from the start; the pending-icon path isn't replayed.
+    for (auto& [handle, uri] : icons) {
+        if (auto it = byHandle.find(handle); it != byHandle.end()) it->second->icon = uri;
+    }
+    for (auto& [kind, handle] : changes) {
+        w->events.push_back({kind, kind == EventKind::Tick ? nullptr : byHandle[handle]});
+    }
+    w->events.push_back({EventKind::Tick});
+    w->expectedHidden = SIZE_MAX;  // unknown
+    return w;
+}
+
+// ============================================================================
+// Measurement
+// ============================================================================
+
+struct Result {
+    std::string name;
+    size_t events = 0;
+    double eventsPerSec = 0;
+    double allocationsPerEvent = 0;
+    uint64_t p50Ns = 0;
+    uint64_t p99Ns = 0;
+    uint64_t maxNs = 0;
+    size_t hidden = 0;
+    size_t expectedHidden = 0;
+};
+
+struct NullSink {
+    void Message(const wchar_t*, std::wstring_view) {}
+    void Repeated(unsigned) {}
+    void Dropped(uint64_t) {}
+};
+
+// One pass over a freshly built workload.
+Result RunOnce(Workload& w) {
+    w.Reserve();
+    WindowState state;
+    state.dirtyParents.reserve(w.nodes.size());
+    BenchTree::state = &state;
+    BenchTree::rules = &g_builtinRules;
+    NullSink sink;
+
+    std::vector<uint64_t> latencies;
+    latencies.reserve(w.events.size());
+    uint64_t allocations = 0;
+    using Clock = std::chrono::steady_clock;
+    auto begin = Clock::now();
+
+    for (const Event& event : w.events) {
+        uint64_t allocationsBefore = g_allocations;
+        auto start = Clock::now();
+        Handle(event);
+        auto end = Clock::now();
+        allocations += g_allocations - allocationsBefore;
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        // The log thread's side, off the clock
+        if (event.kind == EventKind::Tick) BenchTree::log.Drain(sink);
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    BenchTree::log.Drain(sink);
+    BenchTree::state = nullptr;
+
+    Result result;
+    result.name = w.name;
+    result.events = w.events.size();
+    result.eventsPerSec = result.events / seconds;
+    result.allocationsPerEvent = static_cast<double>(allocations) / result.events;
+    std::sort(latencies.begin(), latencies.end());
+    result.p50Ns = latencies[latencies.size() / 2];
+    result.p99Ns = latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+    result.maxNs = latencies.back();
+    state.hidden.ForEach([&](const void*, auto& entry) {
+        BenchNode* node = BenchTree::Resolve(entry.ref);
+        if (node && !entry.value.separator) result.hidden++;
+    });
+    result.expectedHidden = w.expectedHidden;
+    return result;
+}
+
+// Best of a few runs, each on a fresh copy of the workload.
+template <typename Build>
+Result Run(Build build) {
+    constexpr int kRuns = 5;
+    Result best;
+    for (int run = 0; run < kRuns; run++) {
+        auto w = build();
+        Result result = RunOnce(*w);
+        if (run == 0) {
+            best = result;
+            continue;
+        }
+        best.eventsPerSec = std::max(best.eventsPerSec, result.eventsPerSec);
+        best.allocationsPerEvent = std::min(best.allocationsPerEvent, result.allocationsPerEvent);
+        best.p50Ns = std::min(best.p50Ns, result.p50Ns);
+        best.p99Ns = std::min(best.p99Ns, result.p99Ns);
+        best.maxNs = std::min(best.maxNs, result.maxNs);
+    }
+    return best;
+}
+
+struct Budget {
+    double minEventsPerSec;
+    double maxAllocationsPerEvent;
+    uint64_t maxP99Ns;
+};
+
+// Lines of "workload min_events_per_sec max_allocations_per_event
+// max_p99_ns"; # starts a comment.
+bool LoadBudgets(const std::string& path, std::map<std::string, Budget>& budgets) {
+    std::ifstream file(path);
+    if (!file) return false;
+    std::string line;
+    while (std::getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string name;
+        Budget budget;
+        if (!(fields >> name)) continue;
+        if (!(fields >> budget.minEventsPerSec >> budget.maxAllocationsPerEvent >>
+              budget.maxP99Ns)) {
+            return false;
+        }
+        budgets[name] = budget;
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::string budgetsPath, jsonPath, tracePath;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        if (flag == "--budgets") budgetsPath = argv[i + 1];
+        else if (flag == "--json") jsonPath = argv[i + 1];
+        else if (flag == "--trace") tracePath = argv[i + 1];
+    }
+
+    std::map<std::string, Budget> budgets;
+    if (!budgetsPath.empty() && !LoadBudgets(budgetsPath, budgets)) {
+        std::fprintf(stderr, "can't read budgets from %s\n", budgetsPath.c_str());
+        return 1;
+    }
+
+    std::vector<Result> results;
+    results.push_back(Run(OneWindow));
+    results.push_back(Run(FiftyTabs));
+    results.push_back(Run(SelectionToggles));
+    results.push_back(Run(SettingsChanges));
+    if (!tracePath.empty()) {
+        if (!RecordedTrace(tracePath)) {
+            std::fprintf(stderr, "can't read trace %s\n", tracePath.c_str());
+            return 1;
+        }
+        results.push_back(Run([&] { return RecordedTrace(tracePath); }));
+    }
+
+    int missed = 0;
+    std::ostringstream json;
+    json << "{\n  \"workloads\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        std::vector<std::string> failures;
+        if (r.expectedHidden != SIZE_MAX && r.hidden != r.expectedHidden) {
+            failures.push_back("hidden " + std::to_string(r.hidden) + " buttons, expected " +
+                               std::to_string(r.expectedHidden));
+        }
+        if (auto it = budgets.find(r.name); it != budgets.end()) {
+            const Budget& b = it->second;
+            if (r.allocationsPerEvent > b.maxAllocationsPerEvent) {
+                failures.push_back("allocations_per_event");
+            }
+#ifdef ECBH_TIMING_GATES
+            if (r.eventsPerSec < b.minEventsPerSec) failures.push_back("events_per_sec");
+            if (r.p99Ns > b.maxP99Ns) failures.push_back("p99_ns");
+#endif
+        }
+        for (const auto& failure : failures) {
+            std::fprintf(stderr, "%s: over budget: %s\n", r.name.c_str(), failure.c_str());
+        }
+        missed += static_cast<int>(failures.size());
+
+        char line[512];
+        std::snprintf(line, sizeof(line),
+                      "    {\"name\": \"%s\", \"events\": %zu, \"events_per_sec\": %.0f, "
+                      "\"allocations_per_event\": %.3f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+                      "\"max_ns\": %llu, \"hidden\": %zu, \"within_budget\": %s}%s\n",
+                      r.name.c_str(), r.events, r.eventsPerSec, r.allocationsPerEvent,
+                      static_cast<unsigned long long>(r.p50Ns),
+                      static_cast<unsigned long long>(r.p99Ns),
+                      static_cast<unsigned long long>(r.maxNs), r.hidden,
+                      failures.empty() ? "true" : "false",
+                      i + 1 < results.size() ? "," : "");
+        json << line;
+    }
+    json << "  ],\n  \"budgets_missed\": " << missed << "\n}\n";
+
+    std::fputs(json.str().c_str(), stdout);
+    if (!jsonPath.empty()) std::ofstream(jsonPath) << json.str();
+    return missed;
+}
@@ -0,0 +1,19 @@
+// Minimal assertions for the core tests: a failed CHECK prints its location
+// and the test carries on; main returns the number of failures.
+
+#pragma once
+
+#include <cstdio>
+
+inline int g_failures = 0;
+
+#define CHECK(cond)                                                       \
+    do {                                                                  \
+        if (!(cond)) {                                                    \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,   \
+                         __LINE__, #cond);                                \
+            g_failures++;                                                 \
+        }                                                                 \
+    } while (0)
+
+#define CHECK_EQ(a, b) CHECK((a) == (b))
@@ -0,0 +1,116 @@
+// Checks the TAP connection search against a fake InitializeXamlDiagnosticsEx:
+// the remembered index succeeding, failing with ERROR_NOT_FOUND or another
+// error, the search skipping it, stopping at the first other result, and
+// finding nothing.
+
+#include "check.h"
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+#include <map>
+
+namespace {
+
+constexpr HRESULT kNotFound = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+constexpr HRESULT kOk = 0;
+constexpr HRESULT kAccessDenied = static_cast<HRESULT>(0x80070005);
+
+// Answers with results[index], ERROR_NOT_FOUND for any other index, and
+// records the indices tried.
+struct FakeIxde {
+    std::map<int, HRESULT> results;
+    std::vector<int> tried{};
+
+    HRESULT operator()(int index) {
+        tried.push_back(index);
+        auto it = results.find(index);
+        return it == results.end() ? kNotFound : it->second;
+    }
+};
+
+ConnectionSearchResult Find(FakeIxde& ixde, int lastIndex, int maxIndex = 100) {
+    return FindDiagConnection(lastIndex, maxIndex, [&](int index) { return ixde(index); });
+}
+
+void TestRememberedSucceeds() {
+    FakeIxde ixde{{{7, kOk}}};
+    auto result = Find(ixde, 7);
+    CHECK_EQ(result.hr, kOk);
+    CHECK_EQ(result.index, 7);
+    CHECK_EQ(result.attempts, 1);
+    CHECK(ixde.tried == std::vector<int>({7}));
+}
+
+void TestRememberedNotFound() {
+    FakeIxde ixde{{{3, kOk}}};
+    auto result = Find(ixde, 7);
+    CHECK_EQ(result.hr, kOk);
+    CHECK_EQ(result.index, 3);
+    CHECK_EQ(result.attempts, 4);
+    CHECK(ixde.tried == std::vector<int>({7, 1, 2, 3}));
+}
+
+// Any failure of the remembered index falls back to the search, where only
+// ERROR_NOT_FOUND moves on.
+void TestRememberedFails() {
+    FakeIxde ixde{{{7, kAccessDenied}, {9, kOk}}};
+    auto result = Find(ixde, 7);
+    CHECK_EQ(result.hr, kOk);
+    CHECK_EQ(result.index, 9);
+    CHECK_EQ(result.attempts, 9);
+    CHECK(ixde.tried == std::vector<int>({7, 1, 2, 3, 4, 5, 6, 8, 9}));
+}
+
+void TestSearchSkipsRemembered() {
+    FakeIxde ixde;
+    auto result = Find(ixde, 5, 10);
+    CHECK_EQ(result.attempts, 10);
+    CHECK_EQ(std::count(ixde.tried.begin(), ixde.tried.end(), 5), 1);
+    CHECK_EQ(ixde.tried.front(), 5);
+}
+
+void TestSearchStopsAtOtherFailure() {
+    FakeIxde ixde{{{4, kAccessDenied}, {6, kOk}}};
+    auto result = Find(ixde, 0);
+    CHECK_EQ(result.hr, kAccessDenied);
+    CHECK_EQ(result.index, 4);
+    CHECK_EQ(result.attempts, 4);
+}
+
+void TestNothingFound() {
+    FakeIxde ixde;
+    auto result = Find(ixde, 0, 50);
+    CHECK_EQ(result.hr, kNotFound);
+    CHECK_EQ(result.index, 0);
+    CHECK_EQ(result.attempts, 50);
+
+    FakeIxde remembered;
+    result = Find(remembered, 20, 50);
+    CHECK_EQ(result.hr, kNotFound);
+    CHECK_EQ(result.index, 0);
+    CHECK_EQ(result.attempts, 50);
+}
+
+// A remembered index outside 1..maxIndex, e.g. from before kMaxConnectionIndex
+// shrank, isn't tried on its own.
+void TestRememberedOutOfRange() {
+    for (int lastIndex : {-1, 0, 101}) {
+        FakeIxde ixde{{{2, kOk}}};
+        auto result = Find(ixde, lastIndex);
+        CHECK_EQ(result.index, 2);
+        CHECK(ixde.tried == std::vector<int>({1, 2}));
+    }
+}
+
+}  // namespace
+
+int main() {
+    TestRememberedSucceeds();
+    TestRememberedNotFound();
+    TestRememberedFails();
+    TestSearchSkipsRemembered();
+    TestSearchStopsAtOtherFailure();
+    TestNothingFound();
+    TestRememberedOutOfRange();
+    return g_failures;
+}
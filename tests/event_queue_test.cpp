@@ -0,0 +1,177 @@
+// Checks the visual tree event queue: arrival order, deduplication of
+// waiting handles, re-queueing taken ones, and clearing between bursts.
+// A stress test pushes random bursts through it and a reference model,
+// draining in bounded batches that push more events as they go, and checks
+// that storage stops growing once the bursts stop growing.
+
+#include "check.h"
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+#include <chrono>
+#include <deque>
+#include <random>
+#include <set>
+
+namespace {
+
+TreeEvent Event(InstanceHandle handle, uint64_t addedAt = 0) {
+    return {handle, TreeEventKind::AppBarButton, addedAt};
+}
+
+std::vector<InstanceHandle> DrainAll(TreeEventQueue& queue) {
+    std::vector<InstanceHandle> handles;
+    TreeEvent event;
+    while (queue.Pop(event)) handles.push_back(event.handle);
+    return handles;
+}
+
+void TestOrderAndDedup() {
+    TreeEventQueue queue;
+    CHECK(queue.Empty());
+    CHECK(queue.Push(Event(10, 1)));
+    CHECK(queue.Push(Event(20)));
+    CHECK(!queue.Push(Event(10, 2)));  // waiting: the first event stays
+    CHECK(queue.Push(Event(30)));
+    CHECK_EQ(queue.Depth(), 3u);
+
+    TreeEvent event;
+    CHECK(queue.Pop(event));
+    CHECK_EQ(event.handle, 10u);
+    CHECK_EQ(event.addedAt, 1u);
+    CHECK_EQ(queue.Depth(), 2u);
+
+    // Taken, so it can be queued again, behind the others.
+    CHECK(queue.Push(Event(10, 3)));
+    CHECK(!queue.Push(Event(10, 4)));
+    CHECK(!queue.Push(Event(20)));
+    CHECK(DrainAll(queue) == std::vector<InstanceHandle>({20, 30, 10}));
+    CHECK(queue.Empty());
+    CHECK(!queue.Pop(event));
+}
+
+void TestClear() {
+    TreeEventQueue queue;
+    queue.Push(Event(1));
+    queue.Push(Event(2));
+    queue.Clear();
+    CHECK(queue.Empty());
+    CHECK_EQ(queue.Depth(), 0u);
+    // Handles from the cleared burst, waiting or not, are new again.
+    CHECK(queue.Push(Event(2)));
+    CHECK(queue.Push(Event(1)));
+    CHECK(!queue.Push(Event(2)));
+    CHECK(DrainAll(queue) == std::vector<InstanceHandle>({2, 1}));
+}
+
+// Enough events to rehash several times, with handles re-queued in between.
+void TestGrowth() {
+    TreeEventQueue queue;
+    for (InstanceHandle h = 1; h <= 1000; h++) CHECK(queue.Push(Event(h)));
+    TreeEvent event;
+    for (int i = 0; i < 500; i++) queue.Pop(event);
+    for (InstanceHandle h = 1; h <= 5000; h++) {
+        CHECK_EQ(queue.Push(Event(h)), h <= 500 || h > 1000);
+    }
+    CHECK_EQ(queue.Depth(), 500u + 500u + 4000u);
+    auto handles = DrainAll(queue);
+    CHECK_EQ(handles.size(), 5000u);
+    CHECK_EQ(handles[0], 501u);
+    CHECK_EQ(handles[500], 1u);
+    CHECK_EQ(handles[1000], 1001u);
+}
+
+// Reference: a FIFO plus the set of waiting handles.
+struct Model {
+    std::deque<InstanceHandle> events;
+    std::multiset<InstanceHandle> waiting;
+
+    bool Push(InstanceHandle handle) {
+        if (waiting.count(handle)) return false;
+        events.push_back(handle);
+        waiting.insert(handle);
+        return true;
+    }
+    bool Pop(InstanceHandle& handle) {
+        if (events.empty()) return false;
+        handle = events.front();
+        events.pop_front();
+        waiting.erase(waiting.find(handle));
+        return true;
+    }
+    void Clear() {
+        events.clear();
+        waiting.clear();
+    }
+};
+
+// Bursts of up to 4000 Add events over a pool of handles small enough to
+// repeat, drained in batches of 64; each processed event may add children
+// the way a new tab's subtree does. Every fifth burst is abandoned midway,
+// like a window closing.
+void TestStress() {
+    std::mt19937 rng(12345);
+    TreeEventQueue queue;
+    Model model;
+    constexpr size_t kBatch = 64;
+    size_t bytesAfterWarmup = 0;
+    size_t events = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int burst = 0; burst < 400; burst++) {
+        size_t size = 1 + rng() % 4000;
+        InstanceHandle pool = 1 + rng() % 6000;
+        bool abandon = burst % 5 == 4;
+        size_t pushed = 0;
+        size_t taken = 0;
+
+        while (pushed < size || !model.events.empty()) {
+            // A chunk of Add events arrives between two drains.
+            for (size_t n = rng() % 200; n-- && pushed < size; pushed++) {
+                InstanceHandle h = 1 + rng() % pool;
+                CHECK_EQ(queue.Push(Event(h)), model.Push(h));
+                events++;
+            }
+            for (size_t n = 0; n < kBatch; n++) {
+                TreeEvent event;
+                InstanceHandle expected;
+                bool got = queue.Pop(event);
+                CHECK_EQ(got, model.Pop(expected));
+                if (!got) break;
+                CHECK_EQ(event.handle, expected);
+                taken++;
+                if (rng() % 8 == 0) {
+                    InstanceHandle child = 1 + rng() % pool;
+                    CHECK_EQ(queue.Push(Event(child)), model.Push(child));
+                }
+            }
+            CHECK_EQ(queue.Depth(), model.events.size());
+            if (abandon && taken > size / 2) break;
+        }
+        queue.Clear();
+        model.Clear();
+
+        // The largest bursts come early: storage is sized by then.
+        if (burst == 99) bytesAfterWarmup = queue.Bytes();
+        if (burst == 0) {
+            for (int i = 0; i < 8000; i++) queue.Push(Event(1000000 + i));
+            queue.Clear();
+        }
+    }
+    CHECK(bytesAfterWarmup > 0);
+    CHECK_EQ(queue.Bytes(), bytesAfterWarmup);
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    std::printf("stress: %zu events, %.1f ns per event including the model\n", events,
+                std::chrono::duration<double, std::nano>(elapsed).count() / events);
+}
+
+}  // namespace
+
+int main() {
+    TestOrderAndDedup();
+    TestClear();
+    TestGrowth();
+    TestStress();
+    return g_failures;
+}
@@ -0,0 +1,105 @@
+// Compares icon matching through RuleTable with the substring chain it
+// replaced, where each hidden icon was a wstring::find over the whole URI,
+// at 3, 50 and 500 patterns. Prints the cost per button; fails only if the
+// two disagree on which buttons to hide.
+
+#include "check.h"
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+#include <chrono>
+
+namespace {
+
+std::vector<std::wstring> Patterns(size_t count) {
+    std::vector<std::wstring> patterns;
+    for (const auto& builtin : kBuiltinRules) patterns.emplace_back(builtin.iconFileName);
+    for (size_t i = patterns.size(); i < count; i++) {
+        patterns.push_back(L"windows.custom" + std::to_wstring(i) + L".svg");
+    }
+    return patterns;
+}
+
+// The original ShouldHideByIcon, generalized from three patterns to n.
+bool FindChain(const std::vector<std::wstring>& patterns, std::wstring_view uri) {
+    for (const auto& pattern : patterns) {
+        if (uri.find(pattern) != std::wstring_view::npos) return true;
+    }
+    return false;
+}
+
+RuleTable Table(const std::vector<std::wstring>& patterns) {
+    RuleTable rules;
+    for (const auto& pattern : patterns) rules.Add({RuleField::Icon, pattern, L""});
+    return rules;
+}
+
+bool TableMatch(const RuleTable& rules, std::wstring_view uri) {
+    return rules.Evaluate([&](RuleField) { return uri; },
+                          [](std::wstring_view) { return false; }) != RuleField::Count;
+}
+
+// A command bar's worth of icon URIs, one in eight hidden.
+std::vector<std::wstring> Uris() {
+    static const wchar_t* const kIcons[] = {
+        L"windows.new.svg", L"windows.cut.svg", L"windows.copy.svg", L"windows.paste.svg",
+        L"windows.rename.svg", L"windows.share.svg", L"windows.delete.svg",
+        L"windows.rotate90.svg",
+    };
+    std::vector<std::wstring> uris;
+    for (int i = 0; i < 64; i++) {
+        uris.push_back(std::wstring(L"ms-appx:///Assets/Images/") + kIcons[i % std::size(kIcons)]);
+    }
+    return uris;
+}
+
+// Best of several runs, so a preempted run doesn't skew the report.
+template <typename Match>
+double NsPerButton(const std::vector<std::wstring>& uris, size_t& hidden, Match&& match) {
+    constexpr int kRuns = 7;
+    constexpr int kRounds = 2000;
+    double best = 0;
+    for (int run = 0; run < kRuns; run++) {
+        hidden = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < kRounds; round++) {
+            for (const auto& uri : uris) hidden += match(uri);
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        double ns = std::chrono::duration<double, std::nano>(elapsed).count() /
+                    (static_cast<double>(kRounds) * uris.size());
+        if (run == 0 || ns < best) best = ns;
+    }
+    hidden /= kRounds;
+    return best;
+}
+
+}  // namespace
+
+int main() {
+    auto uris = Uris();
+    for (size_t count : {3, 50, 500}) {
+        auto patterns = Patterns(count);
+        RuleTable rules = Table(patterns);
+        for (const auto& uri : uris) CHECK_EQ(FindChain(patterns, uri), TableMatch(rules, uri));
+
+        size_t chainHidden, tableHidden;
+        double chain = NsPerButton(uris, chainHidden,
+                                   [&](std::wstring_view uri) { return FindChain(patterns, uri); });
+        double table = NsPerButton(uris, tableHidden,
+                                   [&](std::wstring_view uri) { return TableMatch(rules, uri); });
+        CHECK_EQ(chainHidden, uris.size() / 8);
+        CHECK_EQ(tableHidden, chainHidden);
+        std::printf("%zu patterns: find chain %.1f ns, rule table %.1f ns\n", count, chain, table);
+    }
+
+    // The default configuration takes the built-in path instead of hashing.
+    RuleTable builtins;
+    for (size_t i = 0; i < std::size(kBuiltinRules); i++) builtins.AddBuiltin(i);
+    size_t hidden;
+    double ns = NsPerButton(uris, hidden,
+                            [&](std::wstring_view uri) { return TableMatch(builtins, uri); });
+    CHECK_EQ(hidden, uris.size() / 8);
+    std::printf("%zu built-ins: rule table %.1f ns\n", std::size(kBuiltinRules), ns);
+    return g_failures;
+}
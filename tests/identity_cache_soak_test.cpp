@@ -0,0 +1,185 @@
+// Millions of simulated element add/remove cycles through IdentityCache and
+// CallbackRegistry, checked against a plain map, with memory that must stay
+// flat once the pool has grown to the peak number of live elements.
+
+#include "check.h"
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+#include <random>
+
+namespace {
+
+// An element slot whose address is reused by every element created in it,
+// like freed and reallocated XAML objects. A weak reference to it is only
+// good for the generation it was taken from.
+struct Slot {
+    uint32_t generation = 0;
+    bool alive = false;
+};
+
+struct WeakRef {
+    Slot* slot = nullptr;
+    uint32_t generation = 0;
+
+    bool Alive() const { return slot && slot->alive && slot->generation == generation; }
+};
+
+bool IsAlive(const WeakRef& ref) { return ref.Alive(); }
+
+constexpr size_t kSlots = 4096;
+constexpr size_t kOperations = 3000000;
+
+void TestIdentityCacheSoak() {
+    std::vector<Slot> slots(kSlots);
+    IdentityCache<WeakRef, uint64_t> cache;
+    struct Expected {
+        uint32_t generation;
+        uint64_t value;
+        bool valid;
+    };
+    std::unordered_map<const void*, Expected> model;
+
+    std::mt19937_64 random(12345);
+    size_t bytesAtHalf = 0;
+    size_t peakBytesFirstHalf = 0;
+    size_t peakBytesSecondHalf = 0;
+    size_t peakSize = 0;
+    bool matched = true;
+
+    for (size_t op = 0; op < kOperations; op++) {
+        Slot& slot = slots[random() % kSlots];
+        const void* key = &slot;
+        WeakRef ref{&slot, slot.generation};
+
+        switch (random() % 8) {
+        case 0:
+        case 1:  // an element is created, or the current one goes away
+            if (slot.alive) {
+                slot.alive = false;
+            } else {
+                slot.generation++;
+                slot.alive = true;
+            }
+            break;
+
+        case 2:
+        case 3:  // handled: store a value for the live element
+            if (slot.alive) {
+                cache.Store(key, ref, op, IsAlive);
+                model[key] = {slot.generation, op, true};
+            }
+            break;
+
+        case 4:
+            cache.Invalidate(key);
+            if (auto it = model.find(key); it != model.end()) it->second.valid = false;
+            break;
+
+        case 5:
+            cache.Erase(key);
+            model.erase(key);
+            break;
+
+        default: {
+            // Lookup, as the mod does it: the entry must be this element's. A
+            // dead element's entry may or may not have been purged yet.
+            auto* entry = cache.Find(key);
+            auto it = model.find(key);
+            bool expectLive = slot.alive && it != model.end() &&
+                              it->second.generation == slot.generation;
+            bool live = entry && entry->ref.Alive() && entry->ref.slot == &slot;
+            if (live != expectLive) matched = false;
+            if (live && (entry->value != it->second.value ||
+                         entry->valid != it->second.valid)) {
+                matched = false;
+            }
+            break;
+        }
+        }
+
+        peakSize = std::max(peakSize, cache.Size());
+        if (op < kOperations / 2) {
+            peakBytesFirstHalf = std::max(peakBytesFirstHalf, cache.Bytes());
+            bytesAtHalf = cache.Bytes();
+        } else {
+            peakBytesSecondHalf = std::max(peakBytesSecondHalf, cache.Bytes());
+        }
+    }
+
+    size_t purged = cache.Purge(IsAlive);
+    size_t live = 0;
+    for (auto& [key, expected] : model) {
+        auto* slot = static_cast<const Slot*>(key);
+        if (slot->alive && slot->generation == expected.generation) live++;
+    }
+
+    CHECK(matched);
+    CHECK_EQ(cache.Size(), live);
+    CHECK(peakSize <= 2 * kSlots);
+    // The random walk may set a new peak of live elements late, which grows
+    // the pool by a chunk; growth with the number of operations would show
+    // up as a multiple.
+    CHECK(peakBytesSecondHalf * 4 <= peakBytesFirstHalf * 5);
+    std::printf("identity cache: %zu ops, %zu live, %zu purged at the end, peak %zu "
+                "entries, %zu bytes at half time, peak %zu / %zu bytes per half\n",
+                kOperations, live, purged, peakSize, bytesAtHalf, peakBytesFirstHalf,
+                peakBytesSecondHalf);
+
+    cache.Clear();
+    CHECK_EQ(cache.Size(), 0u);
+    CHECK(cache.Find(&slots[0]) == nullptr);
+}
+
+// Windows come and go: each registers callbacks on its buttons, which die
+// with it, and the dead registrations are purged in one batch.
+void TestCallbackRegistrySoak() {
+    constexpr int kWindows = 20000;
+    constexpr size_t kButtons = 64;
+    std::vector<Slot> slots(kButtons);
+    CallbackRegistry<WeakRef, int64_t> registry;
+    size_t peakBytes = 0;
+    size_t bytesAfterFirst = 0;
+    int64_t token = 0;
+
+    for (int window = 0; window < kWindows; window++) {
+        for (auto& slot : slots) {
+            slot.generation++;
+            slot.alive = true;
+        }
+        for (auto& slot : slots) {
+            WeakRef ref{&slot, slot.generation};
+            auto isSame = [&](const WeakRef& other) { return other.generation == ref.generation; };
+            for (auto purpose : {CallbackPurpose::ReHide, CallbackPurpose::IconChanged}) {
+                if (!registry.Contains(&slot, purpose, isSame)) {
+                    registry.Add(&slot, purpose, ref, ++token, IsAlive);
+                }
+            }
+            // Registering again is a no-op.
+            if (!registry.Contains(&slot, CallbackPurpose::ReHide, isSame)) {
+                registry.Add(&slot, CallbackPurpose::ReHide, ref, ++token, IsAlive);
+            }
+        }
+        CHECK_EQ(registry.LiveCount(), 2 * kButtons);
+
+        for (auto& slot : slots) slot.alive = false;
+        CHECK_EQ(registry.Purge(IsAlive), kButtons);
+        CHECK_EQ(registry.ElementCount(), 0u);
+
+        if (window == 0) bytesAfterFirst = registry.Bytes();
+        peakBytes = std::max(peakBytes, registry.Bytes());
+    }
+
+    CHECK_EQ(peakBytes, bytesAfterFirst);
+    CHECK_EQ(token, static_cast<int64_t>(2 * kButtons) * kWindows);
+    std::printf("callback registry: %d windows of %zu buttons, %zu bytes throughout\n",
+                kWindows, kButtons, peakBytes);
+}
+
+}  // namespace
+
+int main() {
+    TestIdentityCacheSoak();
+    TestCallbackRegistrySoak();
+    return g_failures;
+}
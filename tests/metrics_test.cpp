@@ -0,0 +1,183 @@
+// Checks the metrics recorder's bucketing, percentiles, tick conversion,
+// scoped timing and block swapping against a fake clock, and measures the
+// cost of a sample, which must stay under 20 ns in optimized builds.
+
+#include "check.h"
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+#include <chrono>
+#include <thread>
+
+namespace {
+
+struct FakeClock {
+    static inline uint64_t now = 0;
+    static uint64_t Now() { return now; }
+};
+
+// Counts reads instead of reading a clock, so the benchmark times the
+// recorder and not the platform's clock.
+struct CountingClock {
+    static inline uint64_t now = 0;
+    static uint64_t Now() { return now += 3; }
+};
+
+const ProbeStats& Stats(const MetricsBlock& block, Probe probe) {
+    return block.probes[static_cast<size_t>(probe)];
+}
+
+uint64_t Bucket(const MetricsBlock& block, Probe probe, size_t i) {
+    return Stats(block, probe).buckets[i].load();
+}
+
+void TestBuckets() {
+    auto block = std::make_unique<MetricsBlock>();
+    MetricsRecorder<FakeClock> metrics(block.get());
+    metrics.Record(Probe::TreeChange, 0);
+    metrics.Record(Probe::TreeChange, 1);
+    metrics.Record(Probe::TreeChange, 2);
+    metrics.Record(Probe::TreeChange, 3);
+    metrics.Record(Probe::TreeChange, 4);
+    metrics.Record(Probe::TreeChange, 1000);    // [512, 1024)
+    metrics.Record(Probe::TreeChange, ~0ull);  // clamped to the last bucket
+
+    const ProbeStats& stats = Stats(*block, Probe::TreeChange);
+    CHECK_EQ(stats.SampleCount(), 7u);
+    CHECK_EQ(stats.totalNs.load(), 1010u + ~0ull);  // wraps, like the block does
+    CHECK_EQ(Bucket(*block, Probe::TreeChange, 0), 1u);
+    CHECK_EQ(Bucket(*block, Probe::TreeChange, 1), 1u);
+    CHECK_EQ(Bucket(*block, Probe::TreeChange, 2), 2u);
+    CHECK_EQ(Bucket(*block, Probe::TreeChange, 3), 1u);
+    CHECK_EQ(Bucket(*block, Probe::TreeChange, 10), 1u);
+    CHECK_EQ(Bucket(*block, Probe::TreeChange, kLatencyBuckets - 1), 1u);
+    CHECK_EQ(Stats(*block, Probe::Strategy1).SampleCount(), 0u);
+}
+
+void TestPercentiles() {
+    auto block = std::make_unique<MetricsBlock>();
+    MetricsRecorder<FakeClock> metrics(block.get());
+    for (int i = 0; i < 98; i++) metrics.Record(Probe::ScanSlice, 100);  // < 128
+    metrics.Record(Probe::ScanSlice, 5000);                              // < 8192
+    metrics.Record(Probe::ScanSlice, 5000);
+
+    const ProbeStats& stats = Stats(*block, Probe::ScanSlice);
+    CHECK_EQ(stats.PercentileNs(100, 50), 128u);
+    CHECK_EQ(stats.PercentileNs(100, 98), 128u);
+    CHECK_EQ(stats.PercentileNs(100, 99), 8192u);
+    CHECK_EQ(stats.PercentileNs(100, 100), 8192u);
+
+    metrics.Record(Probe::InjectTap, 0);
+    CHECK_EQ(Stats(*block, Probe::InjectTap).PercentileNs(1, 50), 0u);
+}
+
+void TestTicks() {
+    auto block = std::make_unique<MetricsBlock>();
+    MetricsRecorder<FakeClock> metrics(block.get());
+    CHECK_EQ(metrics.ToTicks(1000), 0u);  // no frequency yet
+
+    metrics.SetFrequency(10000000);  // the usual QPC rate, 100 ns per tick
+    CHECK_EQ(metrics.ToNs(1), 100u);
+    CHECK_EQ(metrics.ToNs(10000000), 1000000000u);
+    CHECK_EQ(metrics.ToTicks(2000000), 20000u);
+
+    metrics.SetFrequency(3000000);  // not a divisor of 1 s: within 1 ns per s
+    uint64_t ns = metrics.ToNs(3000000);
+    CHECK(ns >= 999999999u && ns <= 1000000000u);
+}
+
+void TestScope() {
+    auto block = std::make_unique<MetricsBlock>();
+    MetricsRecorder<FakeClock> metrics(block.get());
+    metrics.SetFrequency(10000000);
+
+    FakeClock::now = 50;
+    {
+        auto probe = metrics.Measure(Probe::CleanupSeparators);
+        FakeClock::now = 80;
+    }
+    const ProbeStats& stats = Stats(*block, Probe::CleanupSeparators);
+    CHECK_EQ(stats.SampleCount(), 1u);
+    CHECK_EQ(stats.totalNs.load(), 3000u);
+
+    FakeClock::now = 100;
+    metrics.RecordSince(Probe::TimeToHide, 90);
+    CHECK_EQ(Stats(*block, Probe::TimeToHide).totalNs.load(), 1000u);
+}
+
+// Samples taken while the shared block is swapped in and out land in
+// whichever block is current; none are lost or torn.
+void TestSwapUnderLoad() {
+    auto local = std::make_unique<MetricsBlock>();
+    auto shared = std::make_unique<MetricsBlock>();
+    MetricsRecorder<FakeClock> metrics(local.get());
+
+    constexpr int kThreads = 4;
+    constexpr int kSamples = 200000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < kSamples; i++) metrics.Record(Probe::TreeChange, 7);
+        });
+    }
+    for (int i = 0; i < 1000; i++) {
+        metrics.Swap(i % 2 ? local.get() : shared.get());
+        std::this_thread::yield();
+    }
+    for (auto& thread : threads) thread.join();
+    CHECK(metrics.Swap(local.get()) != nullptr);
+
+    uint64_t count = Stats(*local, Probe::TreeChange).SampleCount() +
+                     Stats(*shared, Probe::TreeChange).SampleCount();
+    uint64_t total = Stats(*local, Probe::TreeChange).totalNs.load() +
+                     Stats(*shared, Probe::TreeChange).totalNs.load();
+    uint64_t bucket = Bucket(*local, Probe::TreeChange, 3) + Bucket(*shared, Probe::TreeChange, 3);
+    CHECK_EQ(count, uint64_t{kThreads} * kSamples);
+    CHECK_EQ(total, count * 7);
+    CHECK_EQ(bucket, count);
+}
+
+// ============================================================================
+// Benchmark
+// ============================================================================
+
+// Best of several runs of a scoped sample, so a preempted run doesn't skew
+// the result.
+double NsPerSample(MetricsRecorder<CountingClock>& metrics) {
+    constexpr int kRuns = 7;
+    constexpr int kSamples = 1000000;
+    double best = 0;
+    for (int run = 0; run < kRuns; run++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kSamples; i++) {
+            auto probe = metrics.Measure(static_cast<Probe>(i % static_cast<int>(Probe::Count)));
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        double ns = std::chrono::duration<double, std::nano>(elapsed).count() / kSamples;
+        if (run == 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+void ReportCost() {
+    auto block = std::make_unique<MetricsBlock>();
+    MetricsRecorder<CountingClock> metrics(block.get());
+    metrics.SetFrequency(10000000);
+    double ns = NsPerSample(metrics);
+    std::printf("scoped sample, clock read excluded: %.1f ns\n", ns);
+#ifdef ECBH_TIMING_GATES
+    CHECK(ns < 20.0);
+#endif
+}
+
+}  // namespace
+
+int main() {
+    TestBuckets();
+    TestPercentiles();
+    TestTicks();
+    TestScope();
+    TestSwapUnderLoad();
+    ReportCost();
+    return g_failures;
+}
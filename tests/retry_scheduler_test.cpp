@@ -0,0 +1,162 @@
+// Drives RetryScheduler with a fake millisecond clock.
+
+#include "check.h"
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+namespace {
+
+struct FakeElement {
+    bool alive = true;
+    int resolveOnAttempt = 0;  // 0 = never
+    int attempts = 0;
+};
+
+using Scheduler = RetryScheduler<FakeElement*>;
+
+RetryOutcome Recheck(FakeElement* element) {
+    if (!element->alive) return RetryOutcome::Gone;
+    element->attempts++;
+    return element->attempts == element->resolveOnAttempt ? RetryOutcome::Resolved
+                                                          : RetryOutcome::Pending;
+}
+
+struct Left {
+    uint64_t stamp;
+    RetryOutcome outcome;
+    uint64_t atMs;
+};
+
+// Advances the clock straight to each due time until the scheduler is idle
+// or untilMs is reached, and returns the times of the passes.
+std::vector<uint64_t> Run(Scheduler& scheduler, uint64_t& nowMs, std::vector<Left>& left,
+                          uint64_t untilMs = UINT64_MAX) {
+    std::vector<uint64_t> passes;
+    for (;;) {
+        uint64_t due = scheduler.NextDue();
+        if (due == Scheduler::kIdle || due > untilMs) break;
+        CHECK(due >= nowMs);
+        nowMs = due;
+        passes.push_back(nowMs);
+        scheduler.Tick(nowMs, Recheck, [&](uint64_t stamp, RetryOutcome outcome) {
+            left.push_back({stamp, outcome, nowMs});
+        });
+    }
+    return passes;
+}
+
+void TestBackoffAndGiveUp() {
+    Scheduler scheduler;
+    FakeElement element;
+    uint64_t nowMs = 1000;
+    std::vector<Left> left;
+
+    CHECK(scheduler.Add(&element, &element, nowMs, 7));
+    CHECK_EQ(scheduler.NextDue(), 1016u);
+
+    auto passes = Run(scheduler, nowMs, left);
+
+    // 16 ms, doubling up to 1024 ms, 12 tries in all.
+    std::vector<uint64_t> expected;
+    uint64_t t = 1000, delay = 16;
+    for (uint32_t i = 0; i < Scheduler::kMaxAttempts; i++) {
+        t += delay;
+        expected.push_back(t);
+        delay = std::min(delay * 2, Scheduler::kMaxDelayMs);
+    }
+    CHECK(passes == expected);
+    CHECK_EQ(passes.back(), 1000u + 7152);
+    CHECK_EQ(element.attempts, static_cast<int>(Scheduler::kMaxAttempts));
+
+    CHECK_EQ(left.size(), 1u);
+    CHECK_EQ(left[0].stamp, 7u);
+    CHECK(left[0].outcome == RetryOutcome::Pending);
+    CHECK_EQ(scheduler.Size(), 0u);
+    CHECK_EQ(scheduler.NextDue(), Scheduler::kIdle);
+
+    // Once it has left, the same element can be scheduled again.
+    CHECK(scheduler.Add(&element, &element, nowMs, 8));
+}
+
+void TestResolvedAndGone() {
+    Scheduler scheduler;
+    FakeElement resolves{true, 5};
+    FakeElement destroyed;
+    uint64_t nowMs = 0;
+    std::vector<Left> left;
+
+    CHECK(scheduler.Add(&resolves, &resolves, nowMs, 1));
+    CHECK(scheduler.Add(&destroyed, &destroyed, nowMs, 2));
+    CHECK(!scheduler.Add(&resolves, &resolves, nowMs, 3));  // already scheduled
+    CHECK_EQ(scheduler.Size(), 2u);
+
+    // Destroyed before its first pass
+    destroyed.alive = false;
+    Run(scheduler, nowMs, left);
+
+    CHECK_EQ(left.size(), 2u);
+    CHECK_EQ(left[0].stamp, 2u);
+    CHECK(left[0].outcome == RetryOutcome::Gone);
+    CHECK_EQ(left[0].atMs, 16u);
+    CHECK_EQ(left[1].stamp, 1u);
+    CHECK(left[1].outcome == RetryOutcome::Resolved);
+    CHECK_EQ(left[1].atMs, 16u + 32 + 64 + 128 + 256);
+    CHECK_EQ(resolves.attempts, 5);
+}
+
+void TestBatchedPass() {
+    constexpr int kElements = 1000;
+    Scheduler scheduler;
+    std::vector<FakeElement> elements(kElements);
+    uint64_t nowMs = 0;
+    std::vector<Left> left;
+
+    // Added over 10 ms, a hundred per millisecond; each pass rechecks all
+    // the entries due by then. Odd ones resolve on their first recheck.
+    for (int i = 0; i < kElements; i++) {
+        elements[i].resolveOnAttempt = i % 2 ? 1 : 0;
+        CHECK(scheduler.Add(&elements[i], &elements[i], i / 100, i));
+    }
+    auto passes = Run(scheduler, nowMs, left, 20);
+    CHECK(passes == std::vector<uint64_t>({16, 17, 18, 19, 20}));
+    CHECK_EQ(left.size(), static_cast<size_t>(kElements / 2 / 2));
+    CHECK_EQ(scheduler.Size(), static_cast<size_t>(kElements - kElements / 4));
+
+    // The rest resolve or run out of attempts.
+    Run(scheduler, nowMs, left);
+    CHECK_EQ(left.size(), static_cast<size_t>(kElements));
+    CHECK_EQ(scheduler.Size(), 0u);
+}
+
+void TestAddDuringRecheck() {
+    Scheduler scheduler;
+    FakeElement first{true, 1};
+    FakeElement second{true, 1};
+    std::vector<uint64_t> rechecked;
+
+    scheduler.Add(&first, &first, 0, 0);
+    scheduler.Tick(16, [&](FakeElement* element) {
+        rechecked.push_back(element == &first ? 1 : 2);
+        if (element == &first) scheduler.Add(&second, &second, 16, 0);
+        return Recheck(element);
+    }, [](uint64_t, RetryOutcome) {});
+
+    // The new entry waits for a later pass.
+    CHECK(rechecked == std::vector<uint64_t>{1});
+    CHECK_EQ(scheduler.Size(), 1u);
+    CHECK_EQ(scheduler.NextDue(), 32u);
+
+    scheduler.Clear();
+    CHECK_EQ(scheduler.Size(), 0u);
+    CHECK_EQ(scheduler.NextDue(), Scheduler::kIdle);
+}
+
+}  // namespace
+
+int main() {
+    TestBackoffAndGiveUp();
+    TestResolvedAndGone();
+    TestBatchedPass();
+    TestAddDuringRecheck();
+    return g_failures;
+}
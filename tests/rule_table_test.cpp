@@ -0,0 +1,332 @@
+// Checks the hide-rule table (fields, evaluation order, scopes, duplicate
+// values) and ClassifyWithRules, and prints the cost of classifying a
+// button with the built-in rules and with hundreds of rules.
+
+#include "check.h"
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+#include <chrono>
+
+namespace {
+
+struct Element {
+    std::wstring type = L"Microsoft.UI.Xaml.Controls.AppBarButton";
+    std::wstring automationId;
+    std::wstring automationName;
+    std::wstring label;
+    std::wstring icon;
+    std::vector<std::wstring> ancestors;  // x:Names
+};
+
+// Evaluates rules against e, recording the fields and scopes it looked at.
+struct Evaluation {
+    RuleField matched;
+    std::vector<RuleField> read;
+    std::vector<std::wstring> scopes;
+};
+
+std::wstring_view FieldOf(const Element& e, RuleField field) {
+    switch (field) {
+    case RuleField::Type: return e.type;
+    case RuleField::AutomationId: return e.automationId;
+    case RuleField::AutomationName: return e.automationName;
+    case RuleField::Label: return e.label;
+    case RuleField::Icon: return e.icon;
+    case RuleField::Count: break;
+    }
+    return {};
+}
+
+bool InScope(const Element& e, std::wstring_view name) {
+    return std::find(e.ancestors.begin(), e.ancestors.end(), name) != e.ancestors.end();
+}
+
+Evaluation Evaluate(const RuleTable& rules, const Element& e) {
+    Evaluation result;
+    result.matched = rules.Evaluate(
+        [&](RuleField field) {
+            result.read.push_back(field);
+            return FieldOf(e, field);
+        },
+        [&](std::wstring_view scope) {
+            result.scopes.emplace_back(scope);
+            return InScope(e, scope);
+        });
+    return result;
+}
+
+Classification<std::wstring_view> Classify(const RuleTable& rules, const Element& e) {
+    return ClassifyWithRules<std::wstring_view>(rules,
+        [&](RuleField field) { return FieldOf(e, field); },
+        [&](std::wstring_view scope) { return InScope(e, scope); });
+}
+
+constexpr const wchar_t* kRotateUri = L"ms-appx:///Assets/Images/windows.rotate90.svg";
+constexpr const wchar_t* kCopyUri = L"ms-appx:///Assets/Images/windows.copy.svg";
+
+void TestUriFileName() {
+    CHECK(UriFileName(kRotateUri) == L"windows.rotate90.svg");
+    CHECK(UriFileName(L"ms-appx:///a/b.svg?scale=200#frag") == L"b.svg");
+    CHECK(UriFileName(L"C:\\icons\\b.svg") == L"b.svg");
+    CHECK(UriFileName(L"b.svg") == L"b.svg");
+    CHECK(UriFileName(L"ms-appx:///a/") == L"");
+    CHECK(UriFileName(L"") == L"");
+}
+
+void TestFields() {
+    RuleTable rules;
+    rules.Add({RuleField::Type, L"My.Button", L""});
+    rules.Add({RuleField::AutomationId, L"ShareButton", L""});
+    rules.Add({RuleField::AutomationName, L"Share", L""});
+    rules.Add({RuleField::Label, L"Rotate left", L""});
+    rules.Add({RuleField::Icon, L"windows.rotate90.svg", L""});
+    rules.Add({RuleField::Label, L"", L""});  // empty values are ignored
+    CHECK_EQ(rules.Size(), 5u);
+
+    Element e;
+    e.icon = kCopyUri;
+    Evaluation none = Evaluate(rules, e);
+    CHECK(none.matched == RuleField::Count);
+    // Cheapest first; empty fields skip their lookup but are still read.
+    CHECK(none.read == std::vector<RuleField>({RuleField::Type, RuleField::AutomationId,
+                                               RuleField::AutomationName, RuleField::Label,
+                                               RuleField::Icon}));
+
+    e.type = L"My.Button";
+    CHECK(Evaluate(rules, e).matched == RuleField::Type);
+    CHECK_EQ(Evaluate(rules, e).read.size(), 1u);
+    e.type = L"Other";
+
+    e.automationId = L"ShareButton";
+    CHECK(Evaluate(rules, e).matched == RuleField::AutomationId);
+    e.automationId.clear();
+
+    e.automationName = L"Share";
+    CHECK(Evaluate(rules, e).matched == RuleField::AutomationName);
+    e.automationName = L"share";  // exact match only
+    CHECK(Evaluate(rules, e).matched == RuleField::Count);
+
+    e.label = L"Rotate left";
+    CHECK(Evaluate(rules, e).matched == RuleField::Label);
+    e.label.clear();
+
+    // Icons match on the URI's file name.
+    e.icon = kRotateUri;
+    CHECK(Evaluate(rules, e).matched == RuleField::Icon);
+    e.icon = L"ms-appx:///other/windows.rotate90.svg?x=1";
+    CHECK(Evaluate(rules, e).matched == RuleField::Icon);
+    e.icon = L"windows.rotate90.svg.bak";
+    CHECK(Evaluate(rules, e).matched == RuleField::Count);
+
+    // Fields without rules are never read.
+    RuleTable iconOnly;
+    iconOnly.Add({RuleField::Icon, L"windows.rotate90.svg", L""});
+    CHECK(iconOnly.UsesField(RuleField::Icon));
+    CHECK(!iconOnly.UsesField(RuleField::Label));
+    CHECK(Evaluate(iconOnly, e).read == std::vector<RuleField>({RuleField::Icon}));
+
+    RuleTable empty;
+    CHECK(Evaluate(empty, e).read.empty());
+    CHECK(Evaluate(empty, e).matched == RuleField::Count);
+}
+
+void TestScopes() {
+    RuleTable rules;
+    rules.Add({RuleField::Label, L"Share", L"CommandBar"});
+    rules.Add({RuleField::Label, L"Share", L"ContextMenu"});
+    rules.Add({RuleField::Label, L"Delete", L"CommandBar"});
+    rules.Add({RuleField::Label, L"Delete", L""});  // unscoped wins
+    rules.Add({RuleField::Icon, L"windows.copy.svg", L"NavigationPane"});
+
+    Element e;
+    e.label = L"Share";
+    Evaluation out = Evaluate(rules, e);
+    CHECK(out.matched == RuleField::Count);
+    CHECK(out.scopes == std::vector<std::wstring>({L"CommandBar", L"ContextMenu"}));
+
+    e.ancestors = {L"ContextMenu"};
+    CHECK(Evaluate(rules, e).matched == RuleField::Label);
+    e.ancestors = {L"CommandBar"};
+    out = Evaluate(rules, e);
+    CHECK(out.matched == RuleField::Label);
+    CHECK_EQ(out.scopes.size(), 1u);
+
+    // Ancestors are only walked for a value that matched.
+    e.label = L"Copy";
+    CHECK(Evaluate(rules, e).scopes.empty());
+
+    e.label = L"Delete";
+    e.ancestors.clear();
+    out = Evaluate(rules, e);
+    CHECK(out.matched == RuleField::Label);
+    CHECK(out.scopes.empty());
+
+    // A scoped miss on one field falls through to the next.
+    e.label = L"Share";
+    e.icon = kCopyUri;
+    e.ancestors = {L"NavigationPane"};
+    CHECK(Evaluate(rules, e).matched == RuleField::Icon);
+}
+
+void TestBuiltins() {
+    RuleTable rules;
+    CHECK(!rules.UsesField(RuleField::Icon));
+    rules.AddBuiltin(1);  // windows.rotate90.svg
+    rules.AddBuiltin(1);
+    CHECK_EQ(rules.Size(), 1u);
+    CHECK(rules.UsesField(RuleField::Icon));
+
+    Element e;
+    e.icon = kRotateUri;
+    Evaluation out = Evaluate(rules, e);
+    CHECK(out.matched == RuleField::Icon);
+    CHECK(out.read == std::vector<RuleField>({RuleField::Icon}));
+    e.icon = L"ms-appx:///Assets/Images/windows.rotate270.svg";  // not enabled
+    CHECK(Evaluate(rules, e).matched == RuleField::Count);
+
+    // Built-ins sit alongside custom icon rules, including a duplicate, and
+    // ignore scopes.
+    rules.AddBuiltin(0);
+    rules.Add({RuleField::Icon, L"windows.copy.svg", L"CommandBar"});
+    rules.Add({RuleField::Icon, L"windows.rotate90.svg", L"ContextMenu"});
+    CHECK(Evaluate(rules, e).matched == RuleField::Icon);
+    e.icon = kRotateUri;
+    out = Evaluate(rules, e);
+    CHECK(out.matched == RuleField::Icon);
+    CHECK(out.scopes.empty());
+    e.icon = kCopyUri;
+    CHECK(Evaluate(rules, e).matched == RuleField::Count);
+    e.ancestors = {L"CommandBar"};
+    CHECK(Evaluate(rules, e).matched == RuleField::Icon);
+}
+
+void TestClassify() {
+    RuleTable icons;
+    icons.Add({RuleField::Icon, L"windows.rotate90.svg", L""});
+
+    Element e;
+    auto pending = Classify(icons, e);
+    CHECK(pending.verdict == IconVerdict::Pending);
+
+    e.icon = kCopyUri;
+    auto keep = Classify(icons, e);
+    CHECK(keep.verdict == IconVerdict::Keep);
+    CHECK(keep.uri == kCopyUri);
+
+    e.icon = kRotateUri;
+    auto hide = Classify(icons, e);
+    CHECK(hide.verdict == IconVerdict::Hide);
+    CHECK(hide.uri == kRotateUri);
+
+    // Without icon rules, a missing icon doesn't keep the verdict pending,
+    // and a hide reports the value that matched.
+    RuleTable labels;
+    labels.Add({RuleField::Label, L"Share", L""});
+    e.icon.clear();
+    CHECK(Classify(labels, e).verdict == IconVerdict::Keep);
+    e.label = L"Share";
+    auto byLabel = Classify(labels, e);
+    CHECK(byLabel.verdict == IconVerdict::Hide);
+    CHECK(byLabel.uri == L"Share");
+
+    // Mixed: the label matches before the icon is even looked at.
+    labels.Add({RuleField::Icon, L"windows.rotate90.svg", L""});
+    CHECK(Classify(labels, e).verdict == IconVerdict::Hide);
+    e.label = L"Copy";
+    CHECK(Classify(labels, e).verdict == IconVerdict::Pending);
+}
+
+// ============================================================================
+// Benchmark
+// ============================================================================
+
+RuleTable BuiltinRules() {
+    RuleTable rules;
+    for (size_t i = 0; i < std::size(kBuiltinRules); i++) rules.AddBuiltin(i);
+    return rules;
+}
+
+// count rules spread over the label, automation name and icon fields, a
+// fifth of them scoped.
+RuleTable ManyRules(int count) {
+    RuleTable rules;
+    for (int i = 0; i < count; i++) {
+        std::wstring scope = i % 5 == 0 ? L"CommandBar" : L"";
+        switch (i % 3) {
+        case 0: rules.Add({RuleField::Label, L"Label " + std::to_wstring(i), scope}); break;
+        case 1: rules.Add({RuleField::AutomationName, L"Name " + std::to_wstring(i), scope}); break;
+        case 2: rules.Add({RuleField::Icon, L"icon" + std::to_wstring(i) + L".svg", scope}); break;
+        }
+    }
+    for (size_t i = 0; i < std::size(kBuiltinRules); i++) rules.AddBuiltin(i);
+    return rules;
+}
+
+// A command bar's worth of buttons, one in eight hidden by the built-ins.
+std::vector<Element> Buttons() {
+    static const wchar_t* const kIcons[] = {
+        L"windows.new.svg", L"windows.cut.svg", L"windows.copy.svg", L"windows.paste.svg",
+        L"windows.rename.svg", L"windows.share.svg", L"windows.delete.svg",
+        L"windows.rotate90.svg",
+    };
+    std::vector<Element> buttons;
+    for (int i = 0; i < 64; i++) {
+        Element e;
+        e.icon = std::wstring(L"ms-appx:///Assets/Images/") + kIcons[i % std::size(kIcons)];
+        e.label = L"Button " + std::to_wstring(i);
+        e.automationName = e.label;
+        e.ancestors = {L"CommandBar"};
+        buttons.push_back(std::move(e));
+    }
+    return buttons;
+}
+
+// Best of several runs, so a preempted run doesn't skew the report.
+double NsPerClassification(const RuleTable& rules, const std::vector<Element>& buttons,
+                           size_t& hidden) {
+    constexpr int kRuns = 7;
+    constexpr int kRounds = 4000;
+    double best = 0;
+    for (int run = 0; run < kRuns; run++) {
+        hidden = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < kRounds; round++) {
+            for (const Element& e : buttons) {
+                hidden += Classify(rules, e).verdict == IconVerdict::Hide;
+            }
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        double ns = std::chrono::duration<double, std::nano>(elapsed).count() /
+                    (static_cast<double>(kRounds) * buttons.size());
+        if (run == 0 || ns < best) best = ns;
+    }
+    hidden /= kRounds;
+    return best;
+}
+
+void ReportCost() {
+    auto buttons = Buttons();
+    size_t hidden;
+    double builtin = NsPerClassification(BuiltinRules(), buttons, hidden);
+    CHECK_EQ(hidden, buttons.size() / 8);
+    std::printf("classify, %zu built-in rules: %.1f ns\n", std::size(kBuiltinRules), builtin);
+
+    for (int count : {100, 300, 1000}) {
+        double ns = NsPerClassification(ManyRules(count), buttons, hidden);
+        CHECK_EQ(hidden, buttons.size() / 8);
+        std::printf("classify, %d rules on 3 fields: %.1f ns\n", count, ns);
+    }
+}
+
+}  // namespace
+
+int main() {
+    TestUriFileName();
+    TestFields();
+    TestScopes();
+    TestBuiltins();
+    TestClassify();
+    ReportCost();
+    return g_failures;
+}
@@ -0,0 +1,109 @@
+// Checks the settings snapshot store: publishing, keeping replaced
+// snapshots alive, and readers on other threads classifying against
+// snapshots while new ones are published.
+
+#include "check.h"
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+#include <thread>
+
+namespace {
+
+// Stands in for the mod's Settings: a rule table, and the icon it hides.
+struct Snapshot {
+    uint64_t version = 0;
+    std::wstring icon;
+    RuleTable rules;
+};
+
+std::unique_ptr<const Snapshot> MakeSnapshot(uint64_t version) {
+    auto snapshot = std::make_unique<Snapshot>();
+    snapshot->version = version;
+    snapshot->icon = L"windows.icon" + std::to_wstring(version) + L".svg";
+    snapshot->rules.Add({RuleField::Icon, snapshot->icon, L""});
+    return snapshot;
+}
+
+IconVerdict Verdict(const RuleTable& rules, std::wstring_view icon) {
+    return ClassifyWithRules<std::wstring_view>(rules,
+        [&](RuleField field) {
+            return field == RuleField::Icon ? icon : std::wstring_view();
+        },
+        [](std::wstring_view) { return false; }).verdict;
+}
+
+void TestPublish() {
+    SnapshotStore<Snapshot> store;
+    CHECK(store.Current() == nullptr);
+    CHECK_EQ(store.Count(), 0u);
+
+    const Snapshot& first = store.Publish(MakeSnapshot(1));
+    CHECK(store.Current() == &first);
+    CHECK_EQ(first.version, 1u);
+
+    // A reader still holding the first snapshot can keep using it.
+    const Snapshot* held = store.Current();
+    const Snapshot& second = store.Publish(MakeSnapshot(2));
+    CHECK(store.Current() == &second);
+    CHECK_EQ(store.Count(), 2u);
+    CHECK_EQ(held->version, 1u);
+    CHECK(Verdict(held->rules, held->icon) == IconVerdict::Hide);
+    CHECK(Verdict(held->rules, second.icon) == IconVerdict::Keep);
+}
+
+// Readers classify against whatever snapshot is current while the writer
+// publishes new ones. Each must find a complete snapshot (its rule hides its
+// own icon), never go back to an older one, and eventually see the last.
+void TestConcurrentReaders() {
+    constexpr int kReaders = 4;
+    constexpr uint64_t kVersions = 2000;
+
+    SnapshotStore<Snapshot> store;
+    store.Publish(MakeSnapshot(0));
+
+    std::atomic<int> started{0};
+    std::atomic<uint64_t> inconsistent{0};
+    std::atomic<uint64_t> backwards{0};
+    std::atomic<uint64_t> reads{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < kReaders; i++) {
+        readers.emplace_back([&] {
+            started++;
+            uint64_t last = 0;
+            uint64_t count = 0;
+            while (last != kVersions) {
+                const Snapshot* snapshot = store.Current();
+                if (Verdict(snapshot->rules, snapshot->icon) != IconVerdict::Hide) {
+                    inconsistent++;
+                }
+                if (snapshot->version < last) backwards++;
+                last = snapshot->version;
+                count++;
+            }
+            reads += count;
+        });
+    }
+
+    while (started.load() != kReaders) std::this_thread::yield();
+    for (uint64_t version = 1; version <= kVersions; version++) {
+        store.Publish(MakeSnapshot(version));
+    }
+    for (auto& reader : readers) reader.join();
+
+    CHECK_EQ(inconsistent.load(), 0u);
+    CHECK_EQ(backwards.load(), 0u);
+    CHECK_EQ(store.Count(), kVersions + 1);
+    CHECK(reads.load() >= kReaders);
+    std::printf("%d readers: %llu reads over %llu snapshots\n", kReaders,
+                static_cast<unsigned long long>(reads.load()),
+                static_cast<unsigned long long>(kVersions));
+}
+
+}  // namespace
+
+int main() {
+    TestPublish();
+    TestConcurrentReaders();
+    return g_failures;
+}
@@ -0,0 +1,483 @@
+// Runs the Tree-generic button, label, separator, scan and settings change
+// logic over a simulated visual tree, with every hook call recorded.
+
+#include "check.h"
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+#include <deque>
+#include <map>
+#include <optional>
+
+namespace {
+
+enum class SimKind { Other, Button, Separator };
+
+struct SimNode {
+    SimKind kind = SimKind::Other;
+    std::wstring icon;
+    bool visible = true;
+    bool alive = true;
+    SimNode* parent = nullptr;
+    std::vector<SimNode*> children;
+};
+
+struct SimTree {
+    using Node = SimNode*;
+    using Weak = SimNode*;
+    using Icon = Classification<std::wstring_view>;
+
+    static Node Parent(Node node) { return node->parent; }
+    static int ChildCount(Node node) { return static_cast<int>(node->children.size()); }
+    static Node Child(Node node, int index) { return node->children[index]; }
+    static bool IsButton(Node node) { return node->kind == SimKind::Button; }
+    static bool IsSeparator(Node node) { return node->kind == SimKind::Separator; }
+    static bool IsVisible(Node node) { return node->visible; }
+    static void Collapse(Node node) { node->visible = false; }
+    static void RememberHidden(Node node, bool separator) {
+        State()->hidden.Store(node, node, HiddenElement{separator}, IsAlive);
+    }
+    static bool WasHidden(Node node) {
+        auto* entry = State()->hidden.Find(node);
+        return entry && Resolve(entry->ref) == node;
+    }
+    static void Restore(Node node) {
+        State()->hidden.Erase(node);
+        node->visible = true;
+    }
+    static bool HiddenSeparator(Node node) {
+        return WasHidden(node) && State()->hidden.Find(node)->value.separator;
+    }
+    static const void* Identity(Node node) { return node; }
+    static Weak MakeWeak(Node node) { return node; }
+    static Node Resolve(Weak weak) { return weak && weak->alive ? weak : nullptr; }
+    static bool IsAlive(Weak weak) { return Resolve(weak) != nullptr; }
+
+    static Icon Classify(Node node) { return ClassifyButton<SimTree>(node); }
+    static Icon ClassifyUncached(Node node) {
+        return ClassifyWithRules<std::wstring_view>(rules,
+            [&](RuleField field) {
+                return field == RuleField::Icon ? std::wstring_view(node->icon)
+                                                : std::wstring_view();
+            },
+            [](std::wstring_view) { return false; });
+    }
+
+    static void ScheduleSeparatorCleanup(Node node) {
+        Node parent = node->parent;
+        if (std::find(cleanups.begin(), cleanups.end(), parent) == cleanups.end()) {
+            cleanups.push_back(parent);
+        }
+    }
+    static void WatchHidden(Node node) {
+        watchedHidden.push_back(node);
+        Watch(node, CallbackPurpose::ReHide);
+    }
+    static void WatchPending(Node node, uint64_t addedAt) {
+        watchedPending.push_back({node, addedAt});
+        Watch(node, CallbackPurpose::DeferredCheck);
+    }
+
+    struct Timer {
+        explicit Timer(Probe probe) { measured[probe]++; }
+        ~Timer() { finished++; }
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+    };
+    static Timer Measure(Probe probe) { return Timer(probe); }
+    static void RecordSince(Probe probe, uint64_t start) { since.push_back({probe, start}); }
+    static void LogHidden(const wchar_t* reason, std::wstring_view detail) {
+        log.push_back(std::wstring(reason) + L": " + std::wstring(detail));
+    }
+    static void TraceChildren(Node, const std::vector<SeparatorSlot>& children) {
+        traced.push_back(children.size());
+    }
+
+    static const RuleTable& Rules() { return rules; }
+    static ButtonState<SimTree>* State();
+    static void Watch(Node node, CallbackPurpose purpose) {
+        if (State()->callbacks.Contains(node, purpose, [&](Weak ref) { return ref == node; })) {
+            return;
+        }
+        State()->callbacks.Add(node, purpose, node, 0, IsAlive);
+        watched.push_back({node, purpose});
+    }
+
+    static inline std::deque<SimNode> nodes;
+    static inline RuleTable rules;
+    static inline std::vector<Node> cleanups;
+    static inline std::vector<Node> watchedHidden;
+    static inline std::vector<std::pair<Node, uint64_t>> watchedPending;
+    static inline std::vector<std::pair<Node, CallbackPurpose>> watched;
+    static inline std::map<Probe, int> measured;
+    static inline int finished = 0;
+    static inline std::vector<std::pair<Probe, uint64_t>> since;
+    static inline std::vector<std::wstring> log;
+    static inline std::vector<size_t> traced;
+
+    static void Reset();
+
+    static Node Add(Node parent, SimKind kind, std::wstring icon = {}) {
+        SimNode& node = nodes.emplace_back();
+        node.kind = kind;
+        node.icon = std::move(icon);
+        node.parent = parent;
+        if (parent) parent->children.push_back(&node);
+        return &node;
+    }
+};
+
+std::optional<ButtonState<SimTree>> g_state;
+
+ButtonState<SimTree>* SimTree::State() {
+    return &*g_state;
+}
+
+void SimTree::Reset() {
+    nodes.clear();
+    rules = RuleTable();
+    rules.Add({RuleField::Icon, L"windows.rotate90.svg", L""});
+    g_state.emplace();
+    cleanups.clear();
+    watchedHidden.clear();
+    watchedPending.clear();
+    watched.clear();
+    measured.clear();
+    finished = 0;
+    since.clear();
+    log.clear();
+    traced.clear();
+}
+
+constexpr const wchar_t* kHidden = L"ms-appx:///Assets/windows.rotate90.svg";
+constexpr const wchar_t* kKept = L"ms-appx:///Assets/windows.copy.svg";
+
+void TestProcessAppBarButton() {
+    SimTree::Reset();
+    auto* bar = SimTree::Add(nullptr, SimKind::Other);
+    auto* hide = SimTree::Add(bar, SimKind::Button, kHidden);
+    auto* keep = SimTree::Add(bar, SimKind::Button, kKept);
+    auto* pending = SimTree::Add(bar, SimKind::Button);
+
+    ProcessAppBarButton<SimTree>(hide, 42);
+    CHECK(!hide->visible);
+    CHECK(SimTree::WasHidden(hide));
+    CHECK_EQ(SimTree::log.size(), 1u);
+    CHECK(SimTree::log[0] == std::wstring(L"Hiding button: ") + kHidden);
+    CHECK_EQ(SimTree::since.size(), 1u);
+    CHECK(SimTree::since[0] == std::make_pair(Probe::TimeToHide, uint64_t{42}));
+    CHECK(SimTree::cleanups == std::vector<SimNode*>{bar});
+    CHECK(SimTree::watchedHidden == std::vector<SimNode*>{hide});
+
+    ProcessAppBarButton<SimTree>(keep, 43);
+    CHECK(keep->visible);
+    CHECK(!SimTree::WasHidden(keep));
+
+    ProcessAppBarButton<SimTree>(pending, 44);
+    CHECK(pending->visible);
+    CHECK_EQ(SimTree::watchedPending.size(), 1u);
+    CHECK(SimTree::watchedPending[0] == std::make_pair(pending, uint64_t{44}));
+
+    // Reached again (pre-render path, scan): handled once only.
+    ProcessAppBarButton<SimTree>(hide);
+    CHECK_EQ(SimTree::log.size(), 1u);
+    CHECK_EQ(SimTree::watchedHidden.size(), 1u);
+
+    // Reached without an Add event: nothing to time.
+    auto* late = SimTree::Add(bar, SimKind::Button, kHidden);
+    ProcessAppBarButton<SimTree>(late);
+    CHECK(!late->visible);
+    CHECK_EQ(SimTree::since.size(), 1u);
+
+    CHECK_EQ(SimTree::measured[Probe::ProcessAppBarButton], 5);
+    CHECK_EQ(SimTree::finished, 5);
+}
+
+void TestComputeSeparatorCollapse() {
+    std::vector<bool> collapse;
+
+    // Leading, consecutive and trailing
+    ComputeSeparatorCollapse(
+        {{true, true}, {false, true}, {true, true}, {true, true}, {false, true}, {true, true}},
+        collapse);
+    CHECK(collapse == std::vector<bool>({true, false, false, true, false, true}));
+
+    // Hidden children are skipped, so the separators around them join up.
+    ComputeSeparatorCollapse(
+        {{false, true}, {true, true}, {false, false}, {true, true}, {false, true}},
+        collapse);
+    CHECK(collapse == std::vector<bool>({false, false, false, true, false}));
+
+    ComputeSeparatorCollapse({}, collapse);
+    CHECK(collapse.empty());
+}
+
+void TestCleanupSeparators() {
+    SimTree::Reset();
+    auto* bar = SimTree::Add(nullptr, SimKind::Other);
+    auto* sep0 = SimTree::Add(bar, SimKind::Separator);
+    auto* keep = SimTree::Add(bar, SimKind::Button, kKept);
+    auto* sep1 = SimTree::Add(bar, SimKind::Separator);
+    auto* hide = SimTree::Add(bar, SimKind::Button, kHidden);
+    auto* sep2 = SimTree::Add(bar, SimKind::Separator);
+    auto* keep2 = SimTree::Add(bar, SimKind::Button, kKept);
+
+    ProcessAppBarButton<SimTree>(hide);
+    CHECK(SimTree::cleanups == std::vector<SimNode*>{bar});
+    CleanupSeparatorsNow<SimTree>(bar);
+
+    CHECK(!sep0->visible);  // leading
+    CHECK(keep->visible);
+    CHECK(sep1->visible);
+    CHECK(!sep2->visible);  // next to sep1 once the button is gone
+    CHECK(keep2->visible);
+    CHECK(SimTree::HiddenSeparator(sep0));
+    CHECK(SimTree::HiddenSeparator(sep2));
+    CHECK(!SimTree::HiddenSeparator(hide));
+    CHECK(SimTree::traced == std::vector<size_t>{6});
+    CHECK_EQ(SimTree::measured[Probe::CleanupSeparators], 1);
+
+    // A second pass finds nothing left to do.
+    size_t hiddenCount = SimTree::State()->hidden.Size();
+    CleanupSeparatorsNow<SimTree>(bar);
+    CHECK_EQ(SimTree::State()->hidden.Size(), hiddenCount);
+    CHECK(!sep0->visible);
+    CHECK(!sep2->visible);
+
+    // Once the button shows again, the separator next to it comes back.
+    hide->visible = true;
+    CleanupSeparatorsNow<SimTree>(bar);
+    CHECK(!sep0->visible);
+    CHECK(sep1->visible);
+    CHECK(sep2->visible);
+    CHECK(!SimTree::WasHidden(sep2));
+    CHECK(SimTree::HiddenSeparator(sep0));
+}
+
+void TestFindOwningButton() {
+    SimTree::Reset();
+    auto* bar = SimTree::Add(nullptr, SimKind::Other);
+    auto* button = SimTree::Add(bar, SimKind::Button, kHidden);
+    auto* grid = SimTree::Add(button, SimKind::Other);
+    auto* panel = SimTree::Add(grid, SimKind::Other);
+    auto* label = SimTree::Add(panel, SimKind::Other);
+    auto* icon = SimTree::Add(panel, SimKind::Other);
+    auto* stray = SimTree::Add(bar, SimKind::Other);
+
+    OwnerMap<SimTree> map;
+    CHECK(FindOwningButton<SimTree>(label, &map) == button);
+    CHECK_EQ(map.owners.hits, 0u);
+    CHECK_EQ(map.owners.Size(), 3u);  // panel, grid, button
+
+    // A sibling in the same template resolves on its first lookup.
+    CHECK(FindOwningButton<SimTree>(icon, &map) == button);
+    CHECK_EQ(map.owners.hits, 1u);
+
+    // No owner up to the root; remembered as such.
+    CHECK(FindOwningButton<SimTree>(stray, &map) == nullptr);
+    auto* strayChild = SimTree::Add(stray, SimKind::Other);
+    uint64_t hits = map.owners.hits;
+    CHECK(FindOwningButton<SimTree>(strayChild, &map) == nullptr);
+    CHECK_EQ(map.owners.hits, hits + 1);
+
+    // A cached level whose element is gone is walked again.
+    panel->alive = false;
+    CHECK(FindOwningButton<SimTree>(label, &map) == button);
+
+    // Without a map, the walk still works.
+    CHECK(FindOwningButton<SimTree>(label, nullptr) == button);
+}
+
+// Icons deeper than the walk's limit, like list items: the levels a cut-off
+// walk looked at are remembered as far as they were checked.
+void TestFindOwningButtonDepthLimit() {
+    SimTree::Reset();
+    // button, c1 .. c8, panel: the button is 9 levels above the panel.
+    auto* button = SimTree::Add(nullptr, SimKind::Button, kHidden);
+    auto* chain = button;
+    for (int i = 0; i < 8; i++) chain = SimTree::Add(chain, SimKind::Other);
+    auto* panel = SimTree::Add(chain, SimKind::Other);
+
+    auto addItem = [&] {
+        auto* item = SimTree::Add(panel, SimKind::Other);
+        return SimTree::Add(SimTree::Add(item, SimKind::Other), SimKind::Other);
+    };
+
+    // icon, border, item, panel: the walk stops at c2 without an answer.
+    OwnerMap<SimTree> map;
+    CHECK(FindOwningButton<SimTree>(addItem(), &map) == nullptr);
+    CHECK_EQ(map.owners.hits, 0u);
+    CHECK_EQ(map.owners.Size(), 10u);
+    CHECK_EQ(map.owners.Find(panel)->value.checkedLevels, 8u);
+
+    // The next item reaches the panel at the same depth and stops there.
+    uint64_t levels = map.levels;
+    CHECK(FindOwningButton<SimTree>(addItem(), &map) == nullptr);
+    CHECK_EQ(map.owners.hits, 1u);
+    CHECK_EQ(map.levels, levels + 3);
+
+    // A label right under the panel looks further up than was checked, and
+    // finds the button.
+    auto* label = SimTree::Add(panel, SimKind::Other);
+    CHECK(FindOwningButton<SimTree>(label, &map) == button);
+    CHECK(map.owners.Find(panel)->value.checkedLevels == OwnerMap<SimTree>::kUnbounded);
+}
+
+void TestProcessIconAdded() {
+    SimTree::Reset();
+    auto* bar = SimTree::Add(nullptr, SimKind::Other);
+    auto* button = SimTree::Add(bar, SimKind::Button, kHidden);
+    auto* grid = SimTree::Add(button, SimKind::Other);
+    auto* icon = SimTree::Add(grid, SimKind::Other);
+
+    OwnerMap<SimTree> map;
+    ProcessIconAdded<SimTree>(icon, &map);
+    CHECK(!button->visible);
+    CHECK_EQ(SimTree::log.size(), 1u);
+
+    // The button's own Add event comes later and finds it handled.
+    ProcessAppBarButton<SimTree>(button, 1);
+    CHECK_EQ(SimTree::log.size(), 1u);
+    CHECK(SimTree::since.empty());
+}
+
+void TestInitialScan() {
+    SimTree::Reset();
+    constexpr int kGroups = 50;
+    auto* root = SimTree::Add(nullptr, SimKind::Other);
+    std::vector<SimNode*> buttons;
+    std::vector<SimNode*> groups;
+    for (int i = 0; i < kGroups; i++) {
+        auto* group = SimTree::Add(root, SimKind::Other);
+        auto* button = SimTree::Add(group, SimKind::Button, i % 5 ? kKept : kHidden);
+        SimTree::Add(SimTree::Add(button, SimKind::Other), SimKind::Other);
+        SimTree::Add(group, SimKind::Separator);
+        groups.push_back(group);
+        buttons.push_back(button);
+    }
+
+    TreeScanner<SimTree> scanner(root);
+    uint64_t ticks = 0;
+    auto clock = [&] { return ++ticks; };
+    auto visit = [](SimNode* const& node) { return ScanNode<SimTree>(node); };
+
+    // Every slice is over budget by its first clock read, so it stops after
+    // kClockStride - 1 nodes.
+    CHECK(!scanner.Step(clock, ticks + 1, visit));
+    CHECK_EQ(scanner.visited, TreeScanner<SimTree>::kClockStride - 1);
+
+    // The last group goes away before the walk gets to it.
+    groups.back()->alive = false;
+    while (!scanner.Step(clock, ticks + 1, visit)) {}
+
+    // Root, then each live group with its button and separator; buttons'
+    // templates aren't descended into.
+    CHECK_EQ(scanner.visited, 1u + 3 * (kGroups - 1));
+    CHECK(scanner.slices > 2);
+    CHECK_EQ(scanner.peakStack, static_cast<size_t>(kGroups + 1));
+    for (int i = 0; i < kGroups; i++) {
+        bool shouldHide = i % 5 == 0 && i != kGroups - 1;
+        CHECK(buttons[i]->visible == !shouldHide);
+    }
+    CHECK_EQ(SimTree::log.size(), static_cast<size_t>(kGroups / 5));
+    CHECK_EQ(SimTree::cleanups.size(), static_cast<size_t>(kGroups - 1));
+}
+
+// A contextual button the app hides again while we have it collapsed: the
+// app's write changes nothing and raises no callback, so turning the rule
+// off must not show it. It comes back with the app's next write.
+void TestReapplyLeavesUnhiddenButtonsCollapsed() {
+    SimTree::Reset();
+    auto* bar = SimTree::Add(nullptr, SimKind::Other);
+    auto* keep = SimTree::Add(bar, SimKind::Button, kKept);
+    auto* sep = SimTree::Add(bar, SimKind::Separator);
+    auto* rotate = SimTree::Add(bar, SimKind::Button, kHidden);
+
+    ProcessAppBarButton<SimTree>(rotate);
+    CleanupSeparatorsNow<SimTree>(bar);
+    CHECK(!sep->visible);
+
+    // An image is selected: the app shows it, and it's hidden again.
+    rotate->visible = true;
+    OnHiddenVisibilityChanged<SimTree>(rotate);
+    CHECK(!rotate->visible);
+
+    // The image is deselected, unseen, then the rule is turned off.
+    SimTree::rules = RuleTable();
+    ReapplyCounts counts{};
+    ReapplySettingsOnThread<SimTree>(*SimTree::State(), counts);
+    CHECK_EQ(counts.unhidden.load(), 1u);
+    CHECK_EQ(counts.hidden.load(), 0u);
+    CHECK(!rotate->visible);
+    CHECK(!SimTree::WasHidden(rotate));
+    CHECK(keep->visible);
+    CHECK(!sep->visible);
+
+    // An image is selected again: the app's write shows it, and it stays,
+    // with its separator.
+    SimTree::cleanups.clear();
+    rotate->visible = true;
+    OnHiddenVisibilityChanged<SimTree>(rotate);
+    CHECK(rotate->visible);
+    CHECK(SimTree::cleanups == std::vector<SimNode*>{bar});
+    CleanupSeparatorsNow<SimTree>(bar);
+    CHECK(sep->visible);
+    CHECK_EQ(SimTree::State()->hidden.Size(), 0u);
+}
+
+// Buttons classified while no rule was enabled have no callbacks at all,
+// and are still found when one is turned on.
+void TestReapplyHidesButtonsClassifiedWithoutRules() {
+    SimTree::Reset();
+    SimTree::rules = RuleTable();
+    auto* bar = SimTree::Add(nullptr, SimKind::Other);
+    auto* rotate = SimTree::Add(bar, SimKind::Button, kHidden);
+    auto* keep = SimTree::Add(bar, SimKind::Button, kKept);
+
+    ProcessAppBarButton<SimTree>(rotate);
+    ProcessAppBarButton<SimTree>(keep);
+    CHECK(rotate->visible);
+    CHECK(SimTree::watched.empty());
+    CHECK_EQ(SimTree::State()->callbacks.ElementCount(), 0u);
+
+    SimTree::rules.Add({RuleField::Icon, L"windows.rotate90.svg", L""});
+    ReapplyCounts counts{};
+    ReapplySettingsOnThread<SimTree>(*SimTree::State(), counts);
+    CHECK_EQ(counts.hidden.load(), 1u);
+    CHECK_EQ(counts.unhidden.load(), 0u);
+    CHECK(!rotate->visible);
+    CHECK(SimTree::WasHidden(rotate));
+    CHECK(keep->visible);
+    CHECK(SimTree::watchedHidden == std::vector<SimNode*>{rotate});
+
+    // The icon rule now has each button watched for icon changes.
+    auto watchedFor = [](SimNode* node, CallbackPurpose purpose) {
+        return std::count(SimTree::watched.begin(), SimTree::watched.end(),
+                          std::make_pair(node, purpose)) == 1;
+    };
+    CHECK(watchedFor(rotate, CallbackPurpose::IconChanged));
+    CHECK(watchedFor(keep, CallbackPurpose::IconChanged));
+
+    // Turning it off again releases the button, still collapsed.
+    SimTree::rules = RuleTable();
+    counts.unhidden = 0;
+    ReapplySettingsOnThread<SimTree>(*SimTree::State(), counts);
+    CHECK_EQ(counts.unhidden.load(), 1u);
+    CHECK(!rotate->visible);
+    CHECK(!SimTree::WasHidden(rotate));
+}
+
+}  // namespace
+
+int main() {
+    TestProcessAppBarButton();
+    TestComputeSeparatorCollapse();
+    TestCleanupSeparators();
+    TestFindOwningButton();
+    TestFindOwningButtonDepthLimit();
+    TestProcessIconAdded();
+    TestInitialScan();
+    TestReapplyLeavesUnhiddenButtonsCollapsed();
+    TestReapplyHidesButtonsClassifiedWithoutRules();
+    return g_failures;
+}
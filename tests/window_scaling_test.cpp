@@ -0,0 +1,327 @@
+// Runs the per-window button state over up to 100 simulated File Explorer
+// windows, each with a ButtonState of its own the way each window's UI
+// thread has one. Checks that what a window tracks and what its events cost
+// don't depend on how many other windows are open, that a settings change
+// on one window only touches that window, and that closing one leaves the
+// others as they were. Prints the per-window counts and timings.
+
+#include "check.h"
+
+#include "explorer-command-bar-button-hider.wh.cpp"
+
+#include <chrono>
+#include <deque>
+
+namespace {
+
+enum class SimKind { Other, Button, Separator, Icon, Label };
+
+struct SimNode {
+    SimKind kind = SimKind::Other;
+    std::wstring icon;
+    bool visible = true;
+    SimNode* parent = nullptr;
+    std::vector<SimNode*> children;
+};
+
+struct WindowState;
+
+struct WinTree {
+    using Node = SimNode*;
+    using Weak = SimNode*;
+    using Icon = Classification<std::wstring_view>;
+
+    static Node Parent(Node node) { return node->parent; }
+    static int ChildCount(Node node) { return static_cast<int>(node->children.size()); }
+    static Node Child(Node node, int index) { return node->children[index]; }
+    static bool IsButton(Node node) { return node->kind == SimKind::Button; }
+    static bool IsSeparator(Node node) { return node->kind == SimKind::Separator; }
+    static bool IsVisible(Node node) { return node->visible; }
+    static void Collapse(Node node) { node->visible = false; }
+    static void RememberHidden(Node node, bool separator);
+    static bool WasHidden(Node node);
+    static void Restore(Node node);
+    static const void* Identity(Node node) { return node; }
+    static Weak MakeWeak(Node node) { return node; }
+    static Node Resolve(Weak weak) { return weak; }
+
+    static Icon Classify(Node node) { return ClassifyButton<WinTree>(node); }
+    static Icon ClassifyUncached(Node node) {
+        return ClassifyWithRules<std::wstring_view>(*rules,
+            [&](RuleField field) {
+                return field == RuleField::Icon ? std::wstring_view(node->icon)
+                                                : std::wstring_view();
+            },
+            [](std::wstring_view) { return false; });
+    }
+    static void ScheduleSeparatorCleanup(Node node);
+    static void WatchHidden(Node node) { Watch(node, CallbackPurpose::ReHide); }
+    static void WatchPending(Node node, uint64_t) { Watch(node, CallbackPurpose::DeferredCheck); }
+
+    struct NoTimer {
+        ~NoTimer() {}
+    };
+    static NoTimer Measure(Probe) { return {}; }
+    static void RecordSince(Probe, uint64_t) {}
+    static void LogHidden(const wchar_t*, std::wstring_view) {}
+    static void TraceChildren(Node, const std::vector<SeparatorSlot>&) {}
+
+    static const RuleTable& Rules() { return *rules; }
+    static ButtonState<WinTree>* State();
+    static void Watch(Node node, CallbackPurpose purpose);
+
+    // The window whose UI thread is running, like t_uiThreadState
+    static inline WindowState* current;
+    static inline const RuleTable* rules;
+};
+
+struct WindowState : ButtonState<WinTree> {
+    std::vector<SimNode*> dirtyParents;
+    int64_t nextToken = 0;
+};
+
+ButtonState<WinTree>* WinTree::State() {
+    return current;
+}
+
+void WinTree::RememberHidden(Node node, bool separator) {
+    current->hidden.Store(node, node, HiddenElement{separator}, [](Weak) { return true; });
+}
+
+bool WinTree::WasHidden(Node node) {
+    return current->hidden.Find(node) != nullptr;
+}
+
+void WinTree::Restore(Node node) {
+    current->hidden.Erase(node);
+    node->visible = true;
+}
+
+void WinTree::ScheduleSeparatorCleanup(Node node) {
+    auto& parents = current->dirtyParents;
+    if (std::find(parents.begin(), parents.end(), node->parent) == parents.end()) {
+        parents.push_back(node->parent);
+    }
+}
+
+void WinTree::Watch(Node node, CallbackPurpose purpose) {
+    if (current->callbacks.Contains(node, purpose, [](Weak) { return true; })) return;
+    current->callbacks.Add(node, purpose, node, ++current->nextToken,
+                           [](Weak) { return true; });
+}
+
+// One File Explorer window: a navigation pane, a command bar and a folder
+// view, added in creation order.
+struct SimWindow {
+    std::deque<SimNode> nodes;
+    std::unique_ptr<WindowState> state = std::make_unique<WindowState>();
+
+    SimNode* Add(SimNode* parent, SimKind kind, std::wstring icon = {}) {
+        SimNode& node = nodes.emplace_back();
+        node.kind = kind;
+        node.icon = std::move(icon);
+        node.parent = parent;
+        if (parent) parent->children.push_back(&node);
+        return &node;
+    }
+
+    void AddList(SimNode* parent, int count) {
+        for (int i = 0; i < count; i++) {
+            auto* item = Add(Add(parent, SimKind::Other), SimKind::Other);
+            Add(Add(item, SimKind::Other), SimKind::Icon);
+            Add(Add(item, SimKind::Other), SimKind::Label);
+        }
+    }
+
+    void Build() {
+        static constexpr const wchar_t* kBar[] = {
+            L"windows.new.svg", nullptr, L"windows.cut.svg", L"windows.copy.svg",
+            L"windows.paste.svg", L"windows.share.svg", L"windows.delete.svg", nullptr,
+            L"windows.rotate270.svg", L"windows.rotate90.svg",
+            L"windows.setdesktopwallpaper.svg", nullptr, L"windows.sort.svg",
+            L"windows.view.svg", nullptr, L"windows.more.svg",
+        };
+        auto* root = Add(nullptr, SimKind::Other);
+        AddList(Add(root, SimKind::Other), 30);
+        auto* bar = Add(Add(root, SimKind::Other), SimKind::Other);
+        for (const wchar_t* icon : kBar) {
+            if (!icon) {
+                Add(bar, SimKind::Separator);
+                continue;
+            }
+            auto* button = Add(bar, SimKind::Button,
+                               std::wstring(L"ms-appx:///Assets/Images/") + icon);
+            auto* content = Add(Add(button, SimKind::Other), SimKind::Other);
+            Add(content, SimKind::Icon);
+            Add(content, SimKind::Label);
+        }
+        AddList(Add(root, SimKind::Other), 100);
+    }
+};
+
+// The Add events of a window, handled as the WinUI binding's drain does,
+// then its separator pass. Returns the number of events.
+size_t Open(SimWindow& window) {
+    WinTree::current = window.state.get();
+    WindowState& state = *window.state;
+    for (SimNode& node : window.nodes) {
+        switch (node.kind) {
+        case SimKind::Other:
+            break;
+        case SimKind::Button:
+            ProcessAppBarButton<WinTree>(&node, 1);
+            break;
+        case SimKind::Separator:
+            WinTree::ScheduleSeparatorCleanup(&node);
+            break;
+        case SimKind::Icon:
+            ProcessIconAdded<WinTree>(&node, &state.ownerMap);
+            break;
+        case SimKind::Label:
+            if (auto owner = FindOwningButton<WinTree>(&node, &state.ownerMap)) {
+                ProcessAppBarButton<WinTree>(owner);
+            }
+            break;
+        }
+    }
+    for (SimNode* parent : state.dirtyParents) CleanupSeparatorsNow<WinTree>(parent);
+    state.dirtyParents.clear();
+    WinTree::current = nullptr;
+    return window.nodes.size();
+}
+
+struct Counts {
+    size_t tracked = 0;
+    size_t hidden = 0;
+    size_t callbacks = 0;
+    uint64_t walks = 0;
+
+    bool operator==(const Counts&) const = default;
+};
+
+Counts CountsOf(const WindowState& state) {
+    return {state.TrackedElements(), state.hidden.Size(), state.callbacks.ElementCount(),
+            state.ownerMap.walks};
+}
+
+RuleTable BuiltinRules() {
+    RuleTable rules;
+    for (size_t i = 0; i < std::size(kBuiltinRules); i++) rules.AddBuiltin(i);
+    return rules;
+}
+
+const RuleTable g_builtinRules = BuiltinRules();
+const RuleTable g_noRules;
+
+using Clock = std::chrono::steady_clock;
+
+double Ns(Clock::duration duration) {
+    return static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+struct Timings {
+    double openNsPerEvent = 1e18;
+    double reapplyNs = 1e18;
+    double closeNs = 1e18;
+    uint64_t reapplyClassified = 0;  // buttons the settings change classified
+};
+
+// Opens windowCount windows, each built just before it opens, and times the
+// last one opening. Then times a settings change reaching it, after an
+// unchanged one has brought its state back into the cache, and it closing.
+// Best of a few runs.
+Timings Run(size_t windowCount, const Counts& baseline) {
+    constexpr int kRuns = 5;
+    Timings best;
+    for (int run = 0; run < kRuns; run++) {
+        std::vector<SimWindow> windows(windowCount);
+        WinTree::rules = &g_builtinRules;
+        for (auto& window : windows) {
+            window.Build();
+            auto start = Clock::now();
+            size_t events = Open(window);
+            if (&window == &windows.back()) {
+                best.openNsPerEvent =
+                    std::min(best.openNsPerEvent, Ns(Clock::now() - start) / events);
+            }
+        }
+
+        // Every window tracks the same, however many are open.
+        for (const auto& window : windows) CHECK(CountsOf(*window.state) == baseline);
+
+        // A settings change runs on each window's thread; this one's only
+        // walks what this window tracks.
+        SimWindow& last = windows.back();
+        WinTree::current = last.state.get();
+        ReapplyCounts counts{};
+        ReapplySettingsOnThread<WinTree>(*last.state, counts);
+        CHECK_EQ(counts.unhidden.load() + counts.hidden.load(), 0u);
+
+        WinTree::rules = &g_noRules;
+        uint64_t misses = last.state->verdicts.misses;
+        auto start = Clock::now();
+        ReapplySettingsOnThread<WinTree>(*last.state, counts);
+        best.reapplyNs = std::min(best.reapplyNs, Ns(Clock::now() - start));
+        best.reapplyClassified = last.state->verdicts.misses - misses;
+        WinTree::current = nullptr;
+        CHECK_EQ(counts.unhidden.load(), 3u);
+        CHECK_EQ(counts.hidden.load(), 0u);
+
+        // Closing it frees its state and nothing else.
+        start = Clock::now();
+        last.state.reset();
+        best.closeNs = std::min(best.closeNs, Ns(Clock::now() - start));
+        for (size_t i = 0; i + 1 < windowCount; i++) {
+            CHECK(CountsOf(*windows[i].state) == baseline);
+        }
+    }
+    return best;
+}
+
+void TestScaling() {
+    SimWindow reference;
+    reference.Build();
+    WinTree::rules = &g_builtinRules;
+    Open(reference);
+    const Counts baseline = CountsOf(*reference.state);
+    size_t bytes = reference.state->TrackedBytes();
+
+    // The three contextual buttons, and one of the two separators around
+    // them; each button is watched for the app showing it.
+    CHECK_EQ(baseline.hidden, 4u);
+    CHECK(baseline.callbacks >= 3u);
+
+    std::printf("per window: %zu events, %zu tracked elements, %zu bytes, "
+                "%zu hidden, %zu with callbacks, %llu owner walks\n",
+                reference.nodes.size(), baseline.tracked, bytes, baseline.hidden,
+                baseline.callbacks, static_cast<unsigned long long>(baseline.walks));
+
+    Timings first;
+    for (size_t windows : {1, 10, 50, 100}) {
+        Timings timings = Run(windows, baseline);
+        if (windows == 1) first = timings;
+        std::printf("%3zu windows: open %.1f ns/event, settings change %.1f us "
+                    "(%llu buttons classified), close %.1f us\n",
+                    windows, timings.openNsPerEvent, timings.reapplyNs / 1000,
+                    static_cast<unsigned long long>(timings.reapplyClassified),
+                    timings.closeNs / 1000);
+        CHECK_EQ(timings.reapplyClassified, first.reapplyClassified);
+#ifdef ECBH_TIMING_GATES
+        // Per-window work must not grow with the number of windows open.
+        // The settings change and the close take microseconds, in which the
+        // cache misses of a larger heap show; walking the other windows
+        // would still cost a hundred times as much.
+        CHECK(timings.openNsPerEvent < first.openNsPerEvent * 2);
+        CHECK(timings.reapplyNs < first.reapplyNs * 4);
+        CHECK(timings.closeNs < first.closeNs * 4);
+#endif
+    }
+}
+
+}  // namespace
+
+int main() {
+    TestScaling();
+    return g_failures;
+}